@@ -101,7 +101,7 @@ array, then it performs a reverse FFT to get the audio signal.
 /* The signal power can be this many times weaker than it's strength when it
    was framed before we decide the transmission is complete. You might make
    this larger if cosby thinks it's finished before it's really done or smaller
-   if it never finishes. */
+   if it never finishes. You can also change it with --signal-range= */
 #define SIGNAL_POWER_RANGE 16.0
 
 /* The TI99/4a uses its remote control functionality to start and stop
@@ -111,46 +111,196 @@ array, then it performs a reverse FFT to get the audio signal.
    size of the range it averages in symbols (half a wave at the low
    frequency). 
 
-   You probably won't need to touch it. */
+   You probably won't need to touch it. If you do, there's
+   --power-average= */
 #define POWER_SQ_TOTALS_SIZE 2.0
 
+/* A symbol is a "0" if the "0" frequency is stronger than the "1" by
+   more than this, as a fraction of a full scale "0", and a "1" if
+   it's less. If a tape's "1"s come out a lot weaker than its "0"s,
+   making this a little negative can help. --threshold= */
+#define SLICE_THRESHOLD 0.0
+
+/* If nothing changes for this many symbols, it's the same bit
+   again. --repeat-after= */
+#define REPEAT_AFTER 1.5
+
 /* You'd think this would be called "default." There is something called
    "default," but for some reason this weird string is what you're supposed
    to use. */
 #define ALSA_AUDIO_DEVICE "plughw:0,0"
 
-/* The number of samples to keep in memory when reading from a file.
-   Cosby reads in data in blocks of half this many samples. */
-#define AUDIO_BUFFER_SIZE 4096
+/* The number of samples to keep in memory when reading input. It
+   gets rounded up to fill whole pages of memory. Making it bigger
+   doesn't slow anything down. */
+#define AUDIO_BUFFER_SIZE 65536
+
+/* Cosby reads in input in blocks of this many samples */
+#define AUDIO_READ_SIZE 2048
+
+/* When recording live, this many samples can pile up waiting to be
+   decoded before we start losing them. That's about 24 seconds. */
+#define CAPTURE_QUEUE_SIZE (1024*1024)
+
+/* When the audio comes in at a different sample rate than the
+   decoder works at, each output sample of the resampler looks at
+   this many input samples, times however many input samples there are
+   per output sample. More is sharper and slower. See init_resampler() */
+#define RESAMPLER_TAPS 16
+
+/* The resampler keeps everything below this fraction of the lower
+   sample rate, and gets rid of what's above half of it */
+#define RESAMPLER_CUTOFF 0.45
+
+/* The decoder needs at least this many samples per second. Any fewer
+   and the "1" frequency is too high to hear. */
+#define MIN_SAMPLE_RATE 8000
+
+/* The encoder saves up this many samples before handing them over
+   to be played or written. That's about a third of a second. */
+#define ENCODER_BLOCK_SIZE 16384
+
+/* The engine used to pick the "0" and "1" frequencies out of the
+   input. ENGINE_FFT runs a full FFT for every sample, in batches of
+   FFT_BATCH_SIZE. ENGINE_SDFT
+   (the sliding DFT) updates just the two frequencies we care about
+   as each sample comes in. ENGINE_DIRECT works out just those two
+   from scratch every time, with a loop made for the wavelength. They
+   all give the same answer, and the others are a whole lot faster
+   than the FFT. You can pick one with --engine= */
+#define DEFAULT_ENGINE ENGINE_FFT
+
+/* The FFT engine windows this many samples' worth of windows in a
+   row and runs all their FFTs with one call to FFTW, which is quite a
+   bit less overhead than one call each. */
+#define FFT_BATCH_SIZE 256
+
+/* In symbol timing mode, every time the bit changes, the decoder
+   moves where it looks by this much of how far off the edge between
+   the bits was, and changes how long it thinks a symbol is by this
+   much of it. A symbol can get up to TIMING_MAX_DRIFT longer or
+   shorter than it should be, for tapes that run fast or slow. See
+   run_symbols() */
+#define TIMING_PHASE_GAIN 0.5
+#define TIMING_PERIOD_GAIN 0.05
+#define TIMING_MAX_DRIFT 0.1
+
+/* How hard the cosby program has FFTW look for the fastest way to do
+   the FFT engine's transforms. PLAN_ESTIMATE just guesses, like cosby
+   always has. --plan=measure tries a bunch of ways and times them,
+   which takes a little while the first time. What it finds gets saved
+   in ~/.cache/cosby, so after that it's free. */
+#define DEFAULT_PLAN PLAN_ESTIMATE
+
+/* In fixed point, each 16 bit sample times 16 bit table entry gets
+   shifted down this many bits before it's added up, so the sums fit
+   in 32 bits. That leaves room for a wavelength of up to
+   FIXED_MAX_WAVELENGTH, which is over 350000 samples per second. */
+#define FIXED_SHIFT 8
+#define FIXED_MAX_WAVELENGTH 256
+
+/* The sliding DFT updates running sums, so rounding errors slowly
+   pile up. It throws them away and recomputes the sums from scratch
+   this often, in samples. */
+#define SDFT_REFRESH 4096
+
+/* Until it finds the start of the data, the decoder skips through
+   the audio this many samples at a time, as long as there aren't any
+   "1"s in it or the next block. It has to be a multiple of
+   SDFT_REFRESH. See skip_quiet() */
+#define QUIET_BLOCK_SIZE 4096
+
+/* A window only counts as a "1" if at least this much of its power
+   is the two frequencies we care about, and not noise. A block needs
+   QUIET_MIN_ONES of those to get decoded. */
+#define QUIET_TONE 0.5
+#define QUIET_MIN_ONES 4
+
+/* "cosby scan" looks at the recording this many seconds at a time.
+   A block that's mostly tone is part of a record, and a record is over
+   once there's SCAN_GAP_TIME without any. See scan_recording() */
+#define SCAN_BLOCK_TIME 0.1
+#define SCAN_GAP_TIME 0.5
+
+/* Decoding a record out of an index starts this many seconds before
+   where the index says it starts, so there's some lead-in to find the
+   start of the data with, even if the index came from --records. */
+#define INDEX_LEAD_TIME 0.5
+
+/* Decoded bytes get saved up and written out this many at a time,
+   unless --flush says to write them sooner. See sink_write() */
+#define SINK_BUFFER_SIZE (64*1024)
 
 
 /* =======================================================
                         INCLUDES
    ======================================================= */
 
+/* memfd_create() is a Linux thing */
+#define _GNU_SOURCE
+
 /* Standard C library headers */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <alloca.h>
 #include <stdarg.h>
-
-/* ALSA is used for audio input and output
-   Read about it here http://www.alsa-project.org/ */
-#include <alsa/asoundlib.h>
+#include <ctype.h>
+
+/* POSIX headers for files and memory mapping */
+#include <unistd.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+
+/* On x86, the hot loops come in SSE2, AVX2 and AVX-512 flavors, and
+   we pick one when we start up, depending on what the CPU can do. The
+   compiler builds all of them no matter what -march says. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define COSBY_X86 1
+#include <immintrin.h>
+#endif
 
 /* FFTW3 is the library I use for Fast Fourier Transforms 
    Get it here: http://www.fftw.org/ */
 #include <fftw3.h>
 
+/* The decoder and encoder can be built as a library, libcosby. This
+   is what it looks like from the outside. */
+#include "cosby.h"
+
+/* The library doesn't deal with sound cards or files. Everything
+   inside #ifndef COSBY_LIBRARY is just for the cosby program. */
+#ifndef COSBY_LIBRARY
+
+/* ALSA is used for audio input and output
+   Read about it here http://www.alsa-project.org/ */
+#include <alsa/asoundlib.h>
+
 /* libsndfile is used to read and write WAV files
    http://www.mega-nerd.com/libsndfile/ */
 #include <sndfile.h>
 
+#endif
+
 
-/* Wavelength in samples */
+/* Wavelength in samples. The encoder always works at
+   DEFAULT_SAMPLE_RATE. The decoder works out its own, for whatever
+   rate it's running at. */
 #define DEFAULT_WAVELENGTH ((size_t)(DEFAULT_SAMPLE_RATE/(double)ZERO_FREQ+0.5)) 
-#define DEFAULT_SYMBOL_LENGTH ((size_t)((DEFAULT_SAMPLE_RATE/(double)ZERO_FREQ)/2.0+0.5))
+
+/* The encoder makes every bit exactly half a low wave long */
+#define BIT_AUDIO_SIZE (DEFAULT_WAVELENGTH/2)
+#define BYTE_AUDIO_SIZE (8*BIT_AUDIO_SIZE)
 
 /* Nobody said there would be math involved. Screw you guys. I'm going
    home. */
@@ -160,6 +310,26 @@ array, then it performs a reverse FFT to get the audio signal.
 #define OUTPUT_DEBUG  2
 #define OUTPUT_STDERR 4
 
+#define ENGINE_FFT    COSBY_ENGINE_FFT
+#define ENGINE_SDFT   COSBY_ENGINE_SDFT
+#define ENGINE_DIRECT COSBY_ENGINE_DIRECT
+
+#define SIMD_SCALAR COSBY_SIMD_SCALAR
+#define SIMD_SSE2   COSBY_SIMD_SSE2
+#define SIMD_AVX2   COSBY_SIMD_AVX2
+#define SIMD_AVX512 COSBY_SIMD_AVX512
+
+#define PRECISION_DOUBLE COSBY_PRECISION_DOUBLE
+#define PRECISION_FLOAT  COSBY_PRECISION_FLOAT
+#define PRECISION_FIXED  COSBY_PRECISION_FIXED
+
+#define PLAN_ESTIMATE COSBY_PLAN_ESTIMATE
+#define PLAN_MEASURE  COSBY_PLAN_MEASURE
+#define PLAN_PATIENT  COSBY_PLAN_PATIENT
+
+#define TIMING_SAMPLE COSBY_TIMING_SAMPLE
+#define TIMING_SYMBOL COSBY_TIMING_SYMBOL
+
 /* This program works on chips that arrange binary digits from biggest
    to littlest as well as chips that arrange bytes from littlest to
    biggest. This bit of code figures out which type of machine it's
@@ -183,42 +353,385 @@ const int endian_test = 1;
    contains a class defintion and they're just members of the
    class. For a single file, that's pretty much equivalent
 
+   Well, almost. A class can have more than one instance, and it
+   turns out people want to run dozens of decoders in one
+   process. So, everything a decoder or encoder remembers lives in a
+   struct now. The globals are just the command line settings.
 */
 
 int output_level = DEFAULT_OUTPUT_LEVEL;
 
-/* This is the ugly data we get as input.
+/* The settings for the decoder, like the analysis engine. See
+   cosby.h */
+struct cosby_settings settings;
+
+/* How many recordings batch mode decodes at once. 0 means one per
+   core. */
+int batch_workers = 0;
+
+/* How many threads work on a single recording at once. See
+   decode_in_parallel() */
+int decode_threads = 1;
+
+/* Whether the live recording thread asks for real-time priority. See
+   init_capture_input() */
+int capture_realtime = 0;
+
+/* Whether the last recording found a signal */
+int got_signal = 0;
+
+/* Whether to keep going after the first record on the tape, and
+   save each one to its own file. See start_splitting() */
+int split_records = 0;
+
+/* An index from "cosby scan" or --records to decode from, and which
+   record in it to decode. 0 means all of them. See
+   record_from_index() */
+char *index_filename = NULL;
+int index_record = 0;
+
+/* What a sweep tries, as comma separated lists like "8,16,32". NULL
+   means just the setting. See sweep() */
+char *sweep_signal_range = NULL;
+char *sweep_power_average = NULL;
+char *sweep_threshold = NULL;
+char *sweep_repeat_after = NULL;
+
+/* Whether to look for decoded recordings in the result cache and put
+   them there, and where it is. NULL means ~/.cache/cosby/results. See
+   cache_key() */
+int use_cache = 0;
+char *cache_directory = NULL;
+
+/* Whether to say where the time went, and a file to add it to as
+   JSON. See report_stats() */
+int show_stats = 0;
+char *stats_filename = NULL;
+
+/* The stats for the recording we're decoding right now, if we're
+   keeping track */
+struct stats *recording_stats = NULL;
+
+/* FFTW's planner can only be used by one thread at a time, so
+   everything that makes or gets rid of a plan, or touches the wisdom,
+   holds this while it does */
+pthread_mutex_t planner_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* When decoded bytes get written out, and how many at a time for
+   FLUSH_BYTES. See sink_write() */
+#define FLUSH_RECORD 0
+#define FLUSH_BYTES  1
+#define FLUSH_SIGNAL 2
+int flush_policy = FLUSH_RECORD;
+size_t flush_bytes = 0;
+
+/* Set when somebody hits Ctrl-C, or sends SIGUSR1 to have us write
+   out what we've got. See catch_interrupts() */
+volatile sig_atomic_t interrupted = 0;
+volatile sig_atomic_t flush_requested = 0;
+
+/* Where the recording going on right now is writing to, if it's
+   anywhere, so the decode loops can flush it when asked. See
+   flush_if_requested() */
+struct output_sink *recording_sink = NULL;
+
+/* Where FFTW's wisdom gets loaded from and saved to, whether to
+   bother, and whether it's the one in ~/.cache/cosby. See
+   load_wisdom_file() */
+char *wisdom_file = NULL;
+int use_wisdom = 1;
+int default_wisdom = 0;
+
+/* A circular buffer of the last several values with a running total,
+   so the average doesn't need adding up every time. See running_sum_add() */
+struct running_sum {
+  double *values;
+  size_t size;
+  size_t pos;
+  double total;
+};
+
+/* The average of a block of values, added up as they come in.
+   See block_mean_add() */
+struct block_mean {
+  size_t size;
+  size_t count;
+  double total;
+};
+
+/* Where the time goes. With --stats, everything the decoder and the
+   cosby program do gets charged to one of these stages. There's only
+   one clock, and it charges whatever's running until the next stage
+   starts, so the stages add up to the whole thing, and writing out
+   bytes in the middle of the back end doesn't get counted twice. The
+   clock only gets read going from one stage to another, which is
+   about once a block, so it doesn't slow anything down to speak
+   of. See stats_enter() */
+#define STAGE_OTHER   0 /* Setting up, and anything else */
+#define STAGE_READ    1 /* Reading the recording */
+#define STAGE_COPY    2 /* Getting it into the decoder's buffer */
+#define STAGE_SKIP    3 /* Looking for quiet parts to skip */
+#define STAGE_WINDOW  4 /* Windowing the audio for the FFT engine. The
+			   others build the window into the transform. */
+#define STAGE_ANALYZE 5 /* Finding the power at the two frequencies */
+#define STAGE_SLICE   6 /* Turning the power into bits and bytes */
+#define STAGE_WRITE   7 /* Writing out the bytes */
+#define NUM_STAGES    8
+
+struct stats {
+  double seconds[NUM_STAGES];
+  int stage;
+  double since;
+
+  size_t samples;
+  size_t windows;
+  size_t bits;
+  size_t bytes;
+  size_t records;
+
+  /* What really ran, after the decoder picked what the CPU and the
+     other settings allow */
+  int engine;
+  int simd;
+};
+
+/* Everything one analysis engine needs to turn windows of audio into
+   harmonics. There's one of these for each thread. */
+struct analyzer {
+  /* The audio is doubles, floats or shorts, depending on the
+     precision. See convert_samples() */
+  void (*analyze)(struct analyzer *analyzer, void *audio_samples);
+  fftw_complex *harmonics;
+
+  /* Works out the power for count windows in a row, the first one
+     starting at audio_samples. See analyze_each() */
+  void (*analyze_block)(struct analyzer *analyzer, void *audio_samples, size_t count,
+			double *power_sq, double *power_diff);
+  size_t wavelength;
+  int precision;
+
+  /* The engine it ended up with, which isn't always the one it was
+     asked for. See init_analyzer() */
+  int engine;
+
+  /* The versions of the window multiply and measure_harmonics() for
+     this CPU. See init_analyzer() */
+  void (*apply_window)(double *window, size_t wavelength, double *audio_samples,
+		       double *windowed_samples);
+  void (*measure)(fftw_complex *harmonics, double *power_sq, double *power_diff);
+
+  /* The window applied to the input data before we convert it into
+     the frequency domain. It belongs to the decoder. */
+  double *window;
+
+  /* The plans for the FFT engine, and the windowed audio they read
+     from. get_many_frequencies does batch windows at a time, one
+     after the other in windowed_samples, and the harmonics come out
+     the same way. get_frequencies just does the first one. */
+  fftw_plan get_frequencies;
+  fftw_plan get_many_frequencies;
+  double *windowed_samples;
+  size_t batch;
+
+  /* The sliding DFT keeps a running sum of the audio at four
+     frequencies, which is all it takes to get the first and second
+     harmonics of the windowed audio. See analyze_sdft() */
+  double sdft_sums[4][2];
+  double sdft_turn[4][2];
+  double sdft_enter[4][2];
+  double sdft_leaving;
+  size_t sdft_count;
+
+  /* The direct engine multiplies the audio by the window and the
+     first and second harmonic, all in one table. See init_direct() */
+  double *direct_table;
+
+  /* The same things in single precision and fixed point. See
+     init_low_precision() */
+  float *float_window;
+  float *float_samples;
+  fftwf_complex *float_harmonics;
+  fftwf_plan get_float_frequencies;
+  float *float_table;
+  short *fixed_table;
+
+  /* Usually NULL. See stats_enter() */
+  struct stats *stats;
+};
+
+/* Changes the sample rate of the audio on its way into the
+   decoder. See init_resampler() */
+struct resampler {
+  /* The new rate is the old rate times up, divided by down */
+  size_t up;
+  size_t down;
+
+  /* up filters, taps long each */
+  size_t taps;
+  double *filters;
+
+  /* The last taps input samples, twice over, like the mirrored
+     buffer. See resample() */
+  double *history;
+
+  /* How many input samples we've seen, the input sample the next
+     output sample lines up with, and which filter it needs */
+  size_t count;
+  size_t next;
+  size_t phase;
+};
+
+/* The decoder saves up this many bytes before handing them over */
+#define DECODER_OUTPUT_SIZE 256
+
+struct cosby_decoder {
+  struct cosby_settings settings;
+
+  /* This is the ugly data we get as input.
+
+     I use doubles because FFTW defaults to using doubles, and this
+     program runs in realtime on the slowest Linux box I had
+     around. Not only do I use ridiculous precision, later you'll find
+     out I oversample ridiculously.
+
+     I don't entirely understand the implications of using a lower
+     sample rate or lower precision. So, I don't do it.
+
+     It's a mirrored circular buffer. See map_mirrored(). Sample number
+     n of the input is at audio_buffer[n%audio_buffer_size], and the
+     oldest one we still have is audio_buffer_offset.
+  */
+  double *audio_buffer;
+  size_t audio_buffer_size;
+  size_t audio_buffer_offset;
+  size_t audio_buffer_length;
+
+  /* The analyzer reads from this copy of the buffer, in whatever
+     precision it works in. For doubles, it's just audio_buffer. See
+     decoder_add() */
+  void *work_buffer;
+  size_t sample_size;
+
+  /* The start of the next window to look at */
+  size_t offset;
+
+  /* One wave of the "0" frequency and one symbol, in samples, at the
+     rate the decoder works at. symbol_time is how long a symbol
+     really is, and repeat_after is how long we wait to decide the
+     same bit came again. See cosby_decoder_new() */
+  size_t wavelength;
+  size_t symbol_length;
+  double symbol_time;
+  int repeat_after;
+
+  /* SLICE_THRESHOLD, scaled to the power differences the analyzer
+     comes up with */
+  double threshold;
+
+  /* The widest SIMD instructions we're using. See cosby_decoder_new() */
+  int simd;
+
+  /* If the audio comes in at some other rate, it goes through this
+     first. Audio read with cosby_decoder_buffer() waits in staging
+     until it's resampled. */
+  struct resampler *resampler;
+  double *staging;
+
+  double *window;
+  struct analyzer analyzer;
+
+  /* The power of up to FFT_BATCH_SIZE windows the analyzer has
+     worked out, waiting for process_power() */
+  double power_sq[FFT_BATCH_SIZE];
+  double power_diff[FFT_BATCH_SIZE];
+
+  /* The difference in power of the two frequencies at the last
+     several sample points */
+  struct running_sum power_diffs;
+
+  /* The total signal strength in the frequencies we care about,
+     averaged over a couple of symbols at a time */
+  struct block_mean power_sq_totals;
+  double ave_signal_power_sq;
+
+  /* All the averages since the data was framed, added up, and what
+     a full scale "0" tone would come out to. See
+     cosby_decoder_level() */
+  double signal_power_total;
+  size_t signal_power_count;
+  double full_scale_power_sq;
+
+  /* The bit symbol we're currently looking at, and how many samples
+     we've seen in it. See process_power() */
+  int current_symbol;
+  double sample_count;
+
+  /* Symbol timing: the start of the next window to look at, how long
+     a symbol is on this tape, and the last window we looked at. See
+     run_symbols() */
+  double next_sample;
+  double symbol_period;
+  size_t last_sample;
+  double last_diff;
+  int have_last;
+
+  /* Skipping the quiet parts. The probe looks at a window every
+     symbol to see if there are any "1"s around. The demodulator
+     doesn't need to look past quiet_until before we check again.
+     quiet_block is the last block we checked and whether it was
+     quiet. See skip_quiet() */
+  struct analyzer probe;
+  size_t quiet_until;
+  size_t quiet_block;
+  int quiet_result;
+  int finishing;
+
+  /* Finding the start of the data and putting bits together into
+     bytes. See process_bit() */
+  int framed;
+  int done;
+  char val;
+  int count;
+  int initzeros;
+  int initones;
+
+  unsigned char out[DECODER_OUTPUT_SIZE];
+  size_t out_count;
+
+  cosby_bytes_callback on_bytes;
+  cosby_event_callback on_event;
+  void *user;
+
+  /* The cosby program can have every window's power handed to it
+     too, before the back end sees it. See save_soft() */
+  void (*on_power)(void *user, const double *power_sq, const double *power_diff,
+		   size_t count);
 
-   I use doubles because FFTW defaults to using doubles, and this
-   program runs in realtime on the slowest Linux box I had around. Not
-   only do I use ridiculous precision, later you'll find out I
-   oversample ridiculously.
+  /* And it can have the decoder keep track of where the time goes */
+  struct stats *stats;
+};
 
-   I don't entirely understand the implications of using a lower
-   sample rate or lower precision. So, I don't do it.
- */
-double *audio_buffer;
-size_t audio_buffer_offset;
-size_t audio_buffer_length;
-size_t audio_buffer_section;
-int    audio_eof;
-int    framed = 0;
+struct cosby_encoder {
+  /* A single wave at each frequency. See make_output_audio() */
+  double *zero_audio;
+  double *one_audio;
 
-/* The window applied to the input data before we convert it into the
- frequency domain */
-double *window;
+  /* Whether the next "0" goes up or down */
+  int is_pos;
+  int started;
 
-/* A circular buffer with the difference in power of the two
-   frequencies at the last several sample points*/
-double *power_diffs;
-size_t power_diffs_start = 0;
+  /* The audio for every byte, starting both up and down, and which
+     way each one leaves the wave going. See make_byte_audio() */
+  double *byte_audio;
+  unsigned char byte_ends[2][256];
 
-/* A buffer with a history of total signal strength in for
-   the frequencies we care about */
-double *power_sq_totals;
-size_t power_sq_totals_pos = 0;
-double ave_signal_power_sq = 0.0;
+  /* Audio waiting to go out. See encoder_emit() */
+  double *block;
+  size_t block_count;
 
+  cosby_samples_callback on_samples;
+  void *user;
+};
 
 /* =======================================================
                          Functions
@@ -263,6 +776,96 @@ void cosby_print_err(char *format, ...){
   va_end(ap);    
 }
 
+/* =======================================================
+                    Running statistics
+   ======================================================= */
+
+/* The decoder averages a few values every single sample. Adding them
+   all up every time is a waste, since only one of them changed. These
+   keep running totals instead, so it costs the same no matter how
+   many values are averaged. */
+
+int running_sum_init(struct running_sum *sum, size_t size) {
+  sum->values = fftw_malloc(sizeof(double)*size);
+  if (sum->values == NULL)
+    return 1;
+  for (int c=0;c<size;c++) {
+    sum->values[c] = 0.0;
+  }
+  sum->size = size;
+  sum->pos = 0;
+  sum->total = 0.0;
+  return 0;
+}
+
+void running_sum_free(struct running_sum *sum) {
+  fftw_free(sum->values);
+}
+
+/* Replaces the oldest value with a new one, and returns the total.
+
+   Adding and subtracting doubles over and over slowly piles up
+   rounding errors. So, every time we make it all the way around the
+   buffer, we add everything up again from scratch. That costs one
+   more addition per value, which is still nothing. */
+double running_sum_add(struct running_sum *sum, double value) {
+  sum->total += value - sum->values[sum->pos];
+  sum->values[sum->pos++] = value;
+  if (sum->pos >= sum->size) {
+    sum->pos = 0;
+    sum->total = 0.0;
+    for (int c=0;c<sum->size;c++) {
+      sum->total += sum->values[c];
+    }
+  }
+  return sum->total;
+}
+
+double running_sum_mean(struct running_sum *sum) {
+  return sum->total/sum->size;
+}
+
+void block_mean_init(struct block_mean *mean, size_t size) {
+  mean->size = size;
+  mean->count = 0;
+  mean->total = 0.0;
+}
+
+/* Adds a value to the current block. When the block is full, it puts
+   the average in *result, starts a new block, and returns 1 */
+int block_mean_add(struct block_mean *mean, double value, double *result) {
+  mean->total += value;
+  if (++mean->count < mean->size)
+    return 0;
+  (*result) = mean->total/mean->size;
+  mean->count = 0;
+  mean->total = 0.0;
+  return 1;
+}
+
+double stats_clock() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec+now.tv_nsec/1e9;
+}
+
+/* Charges the time since the last change to the stage that was
+   running, and starts charging stage. Returns the one that was
+   running, so you can go back to it the same way when you're
+   done. Does nothing without stats. */
+int stats_enter(struct stats *stats, int stage) {
+  double now;
+  int previous;
+  if (stats == NULL)
+    return STAGE_OTHER;
+  now = stats_clock();
+  previous = stats->stage;
+  stats->seconds[previous] += now-stats->since;
+  stats->stage = stage;
+  stats->since = now;
+  return previous;
+}
+
 /* =======================================================
                          Playback
    ======================================================= */
@@ -291,8 +894,10 @@ void make_output_audio(double **zero_audio, double **one_audio, size_t low_wavel
   harmonics = (fftw_complex*) fftw_malloc(sizeof(fftw_complex)*num_harmonics);
 
   /* Create a plan to turn the harmonics into the zero symbol audio */
+  pthread_mutex_lock(&planner_lock);
   make_waves = fftw_plan_dft_c2r_1d(low_wavelength, harmonics, (*zero_audio),
 				    FFTW_ESTIMATE);
+  pthread_mutex_unlock(&planner_lock);
 
   /* Initialize the harmonics */
   for (int c=0;c<num_harmonics;c++) {
@@ -333,9 +938,11 @@ void make_output_audio(double **zero_audio, double **one_audio, size_t low_wavel
 
   
   /* Make a new plan for the one audio */
+  pthread_mutex_lock(&planner_lock);
   fftw_destroy_plan(make_waves);
   make_waves = fftw_plan_dft_c2r_1d(low_wavelength, harmonics, (*one_audio),
 				    FFTW_ESTIMATE);
+  pthread_mutex_unlock(&planner_lock);
 
   /* Clean up */
   for (int c=0;c<num_harmonics;c++) {
@@ -365,7 +972,9 @@ void make_output_audio(double **zero_audio, double **one_audio, size_t low_wavel
   fftw_execute(make_waves);
 
   /* Free up everything we're not using */
+  pthread_mutex_lock(&planner_lock);
   fftw_destroy_plan(make_waves);
+  pthread_mutex_unlock(&planner_lock);
   fftw_free(harmonics);
 }
 
@@ -375,20 +984,180 @@ void free_audio_output(double *zero_audio, double *one_audio) {
   fftw_free(one_audio);
 }
 
+/* A bit is only 16 samples. Handing those over one at a time means a
+   trip into ALSA or libsndfile for every bit, and that's where all the
+   time goes. So, we pile the audio up in a big block and send it
+   along when it's full. */
+void encoder_flush(struct cosby_encoder *encoder) {
+  if (encoder->block_count > 0)
+    encoder->on_samples(encoder->user,encoder->block,encoder->block_count);
+  encoder->block_count = 0;
+}
+
+static inline void encoder_emit(struct cosby_encoder *encoder, const double *samples, size_t count) {
+  size_t room;
+  while (count > 0) {
+    room = ENCODER_BLOCK_SIZE-encoder->block_count;
+    if (room > count)
+      room = count;
+    memcpy(encoder->block+encoder->block_count,samples,sizeof(double)*room);
+    encoder->block_count += room;
+    samples += room;
+    count -= room;
+    if (encoder->block_count == ENCODER_BLOCK_SIZE)
+      encoder_flush(encoder);
+  }
+}
+
+/* Get the nth binary digit in a byte. This is what spilts the input
+   data into zeros and ones */
+static inline int get_nth_bit(char byte, size_t n) {
+  return (byte & (1 << n));
+}
+
+/* Finds the audio for a bit. A "1" is a full wave at the high
+   frequency, which is half a wave at the low frequency. A "0" is half
+   a wave at the low frequency, so every "0" flips which way the wave
+   is going. Either way, it's BIT_AUDIO_SIZE samples long. */
+static inline double *bit_audio(struct cosby_encoder *encoder, int bit, int is_pos) {
+  if (bit) {
+    if (is_pos) {
+      /* positive one */
+      return encoder->one_audio;
+    } else {
+      /* negative one */
+      return encoder->one_audio+DEFAULT_WAVELENGTH/4;
+    }
+  } else {
+    if (is_pos) {
+      /* positive zero */
+      return encoder->zero_audio;
+    } else {
+      /* negative zero */
+      return encoder->zero_audio+DEFAULT_WAVELENGTH/2;
+    }
+  }
+}
+
+/* There are only 256 different bytes, and a byte can only start with
+   the wave going up or down. So, we work out the audio for all 512 of
+   them up front, along with which way the wave is going once each one
+   is over. After that, sending a byte is just a copy. */
+int make_byte_audio(struct cosby_encoder *encoder) {
+  double *audio;
+  int is_pos;
+  int bit;
+
+  encoder->byte_audio = malloc(sizeof(double)*2*256*BYTE_AUDIO_SIZE);
+  if (encoder->byte_audio == NULL)
+    return -1;
+  for (int start=0;start<2;start++) {
+    for (int byte=0;byte<256;byte++) {
+      audio = encoder->byte_audio+(start*256+byte)*BYTE_AUDIO_SIZE;
+      is_pos = start;
+      for (int n=7;n>=0;n--) {
+	bit = (get_nth_bit(byte,n) != 0);
+	memcpy(audio,bit_audio(encoder,bit,is_pos),sizeof(double)*BIT_AUDIO_SIZE);
+	audio += BIT_AUDIO_SIZE;
+	if (!bit)
+	  is_pos = !is_pos;
+      }
+      encoder->byte_ends[start][byte] = is_pos;
+    }
+  }
+  return 0;
+}
+
+COSBY_API struct cosby_encoder *cosby_encoder_new(cosby_samples_callback on_samples,
+						  void *user) {
+  struct cosby_encoder *encoder = malloc(sizeof(struct cosby_encoder));
+  if (encoder == NULL)
+    return NULL;
+  encoder->byte_audio = NULL;
+  encoder->block = malloc(sizeof(double)*ENCODER_BLOCK_SIZE);
+  if (encoder->block == NULL) {
+    free(encoder);
+    return NULL;
+  }
+  make_output_audio(&encoder->zero_audio, &encoder->one_audio, DEFAULT_WAVELENGTH);
+  if (make_byte_audio(encoder) < 0) {
+    cosby_encoder_free(encoder);
+    return NULL;
+  }
+  encoder->is_pos = 1;
+  encoder->started = 0;
+  encoder->block_count = 0;
+  encoder->on_samples = on_samples;
+  encoder->user = user;
+  return encoder;
+}
+
+/* Every transmission starts the same way */
+void encoder_start(struct cosby_encoder *encoder) {
+  /* Output five seconds of 0 */
+  for (int c=0;c<DEFAULT_SAMPLE_RATE*5/DEFAULT_WAVELENGTH;c++) {
+    encoder_emit(encoder,encoder->zero_audio,DEFAULT_WAVELENGTH);
+  }
+
+  /* Output a byte of all 1s */
+  for (int n=7;n>=0;n--) {
+    encoder_emit(encoder,encoder->one_audio,DEFAULT_WAVELENGTH/2);
+  }
+  encoder->is_pos = 1;
+  encoder->started = 1;
+}
+
+/* Loop through the data and output the audio for each byte. See
+   make_byte_audio() for where that comes from.
+
+   If you understand this part, you pretty much understand
+   playback. You could just take the sine instead of all that fancy
+   FFT bull. FFTW is at its most ineffecient when it's generating a
+   single wave. It's expensive to make the plan, so it's usually used
+   by running the same plan over and over.
+*/
+COSBY_API void cosby_encoder_write(struct cosby_encoder *encoder,
+				   const unsigned char *bytes, size_t count) {
+  if (!encoder->started)
+    encoder_start(encoder);
+  for (size_t c=0;c<count;c++) {
+    encoder_emit(encoder,encoder->byte_audio+(encoder->is_pos*256+bytes[c])*BYTE_AUDIO_SIZE,
+		 BYTE_AUDIO_SIZE);
+    encoder->is_pos = encoder->byte_ends[encoder->is_pos][bytes[c]];
+  }
+}
+
+COSBY_API void cosby_encoder_finish(struct cosby_encoder *encoder) {
+  if (!encoder->started)
+    encoder_start(encoder);
+
+  /* and an extra half a wave for padding */
+  encoder_emit(encoder,bit_audio(encoder,0,encoder->is_pos),BIT_AUDIO_SIZE);
+  encoder_flush(encoder);
+}
+
+COSBY_API void cosby_encoder_free(struct cosby_encoder *encoder) {
+  free_audio_output(encoder->zero_audio, encoder->one_audio);
+  free(encoder->block);
+  free(encoder->byte_audio);
+  free(encoder);
+}
+
+#ifndef COSBY_LIBRARY
+
 /* You don't need C++ to get polymorphism. These functions give the
    same interface for direct output to the speakers and file
    output. */
 
 /* Output to a file is really simple. */
-int output_to_file(void *out_file, double *samples, size_t count) {
-  return sf_writef_double((SNDFILE *)out_file,samples,count);
+void output_to_file(void *out_file, const double *samples, size_t count) {
+  sf_writef_double((SNDFILE *)out_file,samples,count);
 }
 
 /* output to a speaker requires converting samples to 16bit
    because your soundcard probably uses those */
-int output_to_speaker(void *device, double *samples, size_t count) {
+void output_to_speaker(void *device, const double *samples, size_t count) {
   short *short_samples;
-  int result = 0;
   int err;
 
   /* From the alloca() man page: The alloca() function is machine and
@@ -404,9 +1173,7 @@ int output_to_speaker(void *device, double *samples, size_t count) {
   if ((err = snd_pcm_writei(device,(const void *)short_samples, count)) < 0) {
     snd_pcm_prepare(device);
     cosby_debug("Output troubles... %d\n",err);
-    result = 1;
   }
-  return result;
 }
 
 /* Opens a wave file, and puts the handle in out_file */
@@ -497,23 +1264,17 @@ int init_speaker_output(void **device) {
 }
 
 
-/* Get the nth binary digit in a byte. This is what spilts the input
-   data into zeros and ones */
-inline int get_nth_bit(char byte, size_t n) {
-  return (byte & (1 << n));
-}
+/* The size of the blocks we read the data in */
+#define PLAY_READ_SIZE 4096
 
 /* Initialize. Play out what we need to. Get out. */
 int press_play(char *data_filename, char *wave_filename) {
-  double *one_audio;
-  double *zero_audio;
+  struct cosby_encoder *encoder;
   void *out_file;
   FILE *in_file;
-  char cur_byte;
-  int is_pos;
-  int (*output_samples)(void *,double *,size_t);
-
-  make_output_audio(&zero_audio, &one_audio,DEFAULT_WAVELENGTH);
+  unsigned char bytes[PLAY_READ_SIZE];
+  size_t count;
+  void (*output_samples)(void *,const double *,size_t);
 
   /* If there's no filename, use the standard input */
   if (data_filename == NULL)
@@ -533,57 +1294,14 @@ int press_play(char *data_filename, char *wave_filename) {
     output_samples = &output_to_file;
     init_file_output(&out_file, wave_filename);
   } 
-  /* Output five seconds of 0 */
-  for (int c=0;c<DEFAULT_SAMPLE_RATE*5/DEFAULT_WAVELENGTH;c++) {
-    output_samples(out_file,zero_audio,DEFAULT_WAVELENGTH);
-  }
-
-  /* Output a byte of all 1s */
-  for (int n=7;n>=0;n--) {
-    output_samples(out_file,one_audio,DEFAULT_WAVELENGTH/2);
-  }
-  is_pos = 1;
 
-  /* Loop through the data and output the appropriate
-     portion of the appropriate wave.
-
-     If you understand this part, you pretty much understand
-     playback. You could just take the sine instead of all that fancy
-     FFT bull. FFTW is at its most ineffecient when it's generating a
-     single wave. It's expensive to make the plan, so it's usually
-     used by running the same plan over and over.
-  */
-  while (fread(&cur_byte,1,1,in_file)) {
-    for (int n=7;n>=0;n--) {
-      if (get_nth_bit(cur_byte,n)) {
-	if (is_pos) {
-	  /* positive one */
-	  output_samples(out_file,one_audio,DEFAULT_WAVELENGTH/2);
-	} else {
-	  /* negative one */
-	  output_samples(out_file,one_audio+DEFAULT_WAVELENGTH/4,DEFAULT_WAVELENGTH-DEFAULT_WAVELENGTH/2);
-	}
-      } else {
-	if (is_pos) {
-	  /* positive zero */
-	  output_samples(out_file,zero_audio,DEFAULT_WAVELENGTH/2);
-	} else {
-	  /* negative zero */
-	  output_samples(out_file,zero_audio+DEFAULT_WAVELENGTH/2,DEFAULT_WAVELENGTH-DEFAULT_WAVELENGTH/2);
-	}
-	is_pos = !is_pos;
-      }
-    }
-  }
-
-  /* and an extra half a wave for padding */
-  if (is_pos) {
-    /* positive zero */
-    output_samples(out_file,zero_audio,DEFAULT_WAVELENGTH/2);
-  } else {
-    /* negative zero */
-    output_samples(out_file,zero_audio+DEFAULT_WAVELENGTH/2,DEFAULT_WAVELENGTH-DEFAULT_WAVELENGTH/2);
+  encoder = cosby_encoder_new(output_samples, out_file);
+  if (encoder == NULL)
+    return -1;
+  while ((count = fread(bytes,1,PLAY_READ_SIZE,in_file)) > 0) {
+    cosby_encoder_write(encoder, bytes, count);
   }
+  cosby_encoder_finish(encoder);
 
   if (wave_filename == NULL) {
     /* FIXME You forgot to close the soundcard on the way out, you jerk! */
@@ -594,10 +1312,12 @@ int press_play(char *data_filename, char *wave_filename) {
   /* Close the input file, free the audio */
   if (data_filename != NULL)
     fclose(in_file);
-  free_audio_output(zero_audio, one_audio);
+  cosby_encoder_free(encoder);
   return 0;
 }
 
+#endif
+
 /* =======================================================
                         Record
    ======================================================= */
@@ -613,11 +1333,666 @@ off suddenly.
 So, we multiply the input by a window function that sort of masks
 off the edges. There are several different ones to choose from,
 with subtle differences. */
-void apply_window_func(double *audio_samples) {
+void apply_window_func(double *window, size_t wavelength, double *audio_samples, double *windowed_samples) {
   /* Applies the window function */
-  for (int c=0;c<DEFAULT_WAVELENGTH;c++) {
-    audio_samples[c] *= window[c];
+  for (int c=0;c<wavelength;c++) {
+    windowed_samples[c] = audio_samples[c]*window[c];
+  }
+}
+
+/* Boils the harmonics down to the two numbers the decoder cares
+   about: the total power at the "0" and "1" frequencies, and how much
+   stronger the "0" is than the "1". This part doesn't remember
+   anything from one sample to the next. */
+void measure_harmonics(fftw_complex *harmonics, double *power_sq, double *power_diff) {
+  (*power_sq) = (harmonics[1][0]*harmonics[1][0]+
+		 harmonics[1][1]*harmonics[1][1]+
+		 (harmonics[2][0]*harmonics[2][0]+
+		  harmonics[2][1]*harmonics[2][1]));
+  (*power_diff) = (sqrt(harmonics[1][0]*harmonics[1][0]+harmonics[1][1]*harmonics[1][1])-
+		   sqrt(harmonics[2][0]*harmonics[2][0]+harmonics[2][1]*harmonics[2][1]));
+}
+
+/* How big one sample is, in the analyzer's precision. See
+   convert_samples() */
+size_t precision_size(int precision) {
+  if (precision == PRECISION_FLOAT)
+    return sizeof(float);
+  if (precision == PRECISION_FIXED)
+    return sizeof(short);
+  return sizeof(double);
+}
+
+/* Every engine but the FFT does one window at a time */
+void analyze_each(struct analyzer *analyzer, void *samples, size_t count,
+		  double *power_sq, double *power_diff) {
+  size_t sample_size = precision_size(analyzer->precision);
+  for (size_t c=0;c<count;c++) {
+    analyzer->analyze(analyzer, (char *)samples+c*sample_size);
+    analyzer->measure(analyzer->harmonics, power_sq+c, power_diff+c);
+  }
+}
+
+/* The FFT engine. Window the audio for a batch of windows into the
+   array the plan reads, and run all their FFTs at once. This works
+   out every harmonic, even though we only look at two of them.
+
+   It's the same transform on the same windows as doing them one at
+   a time, just without going in and out of FFTW for each one. The
+   batch plan always does a whole batch, so whatever's left over at
+   the end gets done one at a time. When audio trickles in a few
+   samples at a time, that's all of it. */
+void analyze_fft(struct analyzer *analyzer, void *samples, size_t count,
+		 double *power_sq, double *power_diff) {
+  double *audio_samples = (double *)samples;
+  size_t wavelength = analyzer->wavelength;
+  size_t num_harmonics = wavelength/2+1;
+
+  int stage;
+
+  for (;count >= analyzer->batch;count -= analyzer->batch) {
+    stage = stats_enter(analyzer->stats, STAGE_WINDOW);
+    for (size_t c=0;c<analyzer->batch;c++) {
+      analyzer->apply_window(analyzer->window, wavelength, audio_samples+c,
+			     analyzer->windowed_samples+c*wavelength);
+    }
+    stats_enter(analyzer->stats, stage);
+    fftw_execute(analyzer->get_many_frequencies);
+    for (size_t c=0;c<analyzer->batch;c++) {
+      analyzer->measure(analyzer->harmonics+c*num_harmonics, power_sq+c, power_diff+c);
+    }
+    audio_samples += analyzer->batch;
+    power_sq += analyzer->batch;
+    power_diff += analyzer->batch;
+  }
+  for (size_t c=0;c<count;c++) {
+    analyzer->apply_window(analyzer->window, wavelength, audio_samples+c,
+			   analyzer->windowed_samples);
+    fftw_execute(analyzer->get_frequencies);
+    analyzer->measure(analyzer->harmonics, power_sq+c, power_diff+c);
+  }
+}
+
+/* The sliding DFT engine.
+
+The FFT spends most of its time on harmonics we throw away. Worse,
+the window one sample over is almost exactly the same audio as the
+last one, and the FFT starts from scratch every time anyway.
+
+The window is half a sine wave, and a sine wave is just two complex
+numbers spinning in opposite directions added together. Multiplying
+by the window shifts a harmonic up and down by half a cycle over the
+window. So, the windowed first and second harmonics are made out of
+plain, unwindowed sums at four frequencies: each harmonic, shifted up
+and down.
+
+A plain sum is easy to slide along. Take out the sample leaving the
+window, add the one coming in, and spin everything by one sample's
+worth. That's a handful of multiplies per sample instead of an
+entire FFT. */
+void init_sdft(struct analyzer *analyzer) {
+  size_t wavelength = analyzer->wavelength;
+  double shift = PI/(wavelength-1.0);
+  double freq;
+  for (int c=0;c<4;c++) {
+    /* Harmonic 1 or 2, shifted down or up */
+    freq = 2.0*PI*(c/2+1)/wavelength + ((c%2) ? shift : -shift);
+    analyzer->sdft_turn[c][0] = cos(freq);
+    analyzer->sdft_turn[c][1] = sin(freq);
+    analyzer->sdft_enter[c][0] = cos(freq*wavelength);
+    analyzer->sdft_enter[c][1] = -sin(freq*wavelength);
+  }
+  analyzer->sdft_count = 0;
+}
+
+/* This expects to be called with the window moving over by exactly
+   one sample each time, which is how press_record() works.
+
+   The sums start over every SDFT_REFRESH samples counting from the
+   start of the recording, not from whenever we happened to start. That
+   way, anybody starting at a multiple of SDFT_REFRESH gets exactly the
+   same numbers as somebody who went through from the beginning. */
+void analyze_sdft(struct analyzer *analyzer, void *samples) {
+  double *audio_samples = (double *)samples;
+  double (*sums)[2] = analyzer->sdft_sums;
+  double re, im, freq;
+  size_t wavelength = analyzer->wavelength;
+  double incoming = audio_samples[wavelength-1];
+
+  if (analyzer->sdft_count % SDFT_REFRESH == 0) {
+    /* Every so often, start the sums over from scratch so rounding
+       errors don't build up */
+    for (int c=0;c<4;c++) {
+      freq = atan2(analyzer->sdft_turn[c][1],analyzer->sdft_turn[c][0]);
+      sums[c][0] = 0.0;
+      sums[c][1] = 0.0;
+      for (int n=0;n<wavelength;n++) {
+	sums[c][0] += audio_samples[n]*cos(freq*n);
+	sums[c][1] -= audio_samples[n]*sin(freq*n);
+      }
+    }
+  } else {
+    for (int c=0;c<4;c++) {
+      re = sums[c][0] - analyzer->sdft_leaving + incoming*analyzer->sdft_enter[c][0];
+      im = sums[c][1] + incoming*analyzer->sdft_enter[c][1];
+      sums[c][0] = re*analyzer->sdft_turn[c][0] - im*analyzer->sdft_turn[c][1];
+      sums[c][1] = re*analyzer->sdft_turn[c][1] + im*analyzer->sdft_turn[c][0];
+    }
+  }
+  analyzer->sdft_leaving = audio_samples[0];
+  analyzer->sdft_count++;
+
+  /* Put the two halves of the window back together. Dividing by 2i
+     is the same as what the window does to the FFT */
+  for (int k=1;k<=2;k++) {
+    re = sums[2*k-2][0] - sums[2*k-1][0];
+    im = sums[2*k-2][1] - sums[2*k-1][1];
+    analyzer->harmonics[k][0] = im/2.0;
+    analyzer->harmonics[k][1] = -re/2.0;
+  }
+}
+
+/* The direct engine.
+
+We only want two harmonics, and a harmonic is just the windowed audio
+multiplied by a cosine and a sine, added up. So, multiply the window
+by the cosines and sines ahead of time, and every window of audio is
+four dot products. There's no state, and nothing to slide.
+
+The table is laid out with the four numbers for each sample next to
+each other, so each of the four sums gets added up in order, and
+the compiler can still do all four at once. */
+int init_direct(struct analyzer *analyzer) {
+  size_t wavelength = analyzer->wavelength;
+  double *table;
+  double freq;
+
+  table = malloc(sizeof(double)*4*wavelength);
+  if (table == NULL)
+    return 1;
+  for (int n=0;n<wavelength;n++) {
+    for (int k=1;k<=2;k++) {
+      freq = 2.0*PI*k*n/wavelength;
+      table[n*4+2*k-2] = analyzer->window[n]*cos(freq);
+      table[n*4+2*k-1] = -analyzer->window[n]*sin(freq);
+    }
+  }
+  analyzer->direct_table = table;
+  return 0;
+}
+
+static inline void finish_direct(struct analyzer *analyzer, double *sums) {
+  analyzer->harmonics[1][0] = sums[0];
+  analyzer->harmonics[1][1] = sums[1];
+  analyzer->harmonics[2][0] = sums[2];
+  analyzer->harmonics[2][1] = sums[3];
+}
+
+/* The loop that does it. LENGTH is either a number, so the compiler
+   knows how long the loop is and can unroll the whole thing, or the
+   analyzer's wavelength, so it works for anything. */
+#define DIRECT_KERNEL(NAME, LENGTH)					\
+  void NAME(struct analyzer *analyzer, void *samples) {			\
+    const double *audio_samples = (double *)samples;			\
+    const double *table = analyzer->direct_table;			\
+    double sums[4] = { 0.0, 0.0, 0.0, 0.0 };				\
+    _Pragma("GCC unroll 64")						\
+    for (int n=0;n<LENGTH;n++) {					\
+      for (int j=0;j<4;j++) {						\
+	sums[j] += audio_samples[n]*table[n*4+j];			\
+      }									\
+    }									\
+    finish_direct(analyzer, sums);					\
+  }
+
+/* The same thing with SIMD instructions. An AVX register holds all
+   four sums, and SSE2 takes two. They multiply and add exactly the
+   same numbers in exactly the same order as the plain version, so the
+   answers are exactly the same too.
+
+   AVX-512 could do two samples at once, but then each sum would be
+   added up in two halves, and the answers would come out a tiny bit
+   different. So it uses the AVX version. */
+#ifdef COSBY_X86
+#define DIRECT_KERNEL_SSE2(NAME, LENGTH)				\
+  __attribute__((target("sse2")))					\
+  void NAME(struct analyzer *analyzer, void *samples) {			\
+    const double *audio_samples = (double *)samples;			\
+    const double *table = analyzer->direct_table;			\
+    __m128d low = _mm_setzero_pd();					\
+    __m128d high = _mm_setzero_pd();					\
+    __m128d sample;							\
+    double sums[4];							\
+    _Pragma("GCC unroll 64")						\
+    for (int n=0;n<LENGTH;n++) {					\
+      sample = _mm_set1_pd(audio_samples[n]);				\
+      low = _mm_add_pd(low, _mm_mul_pd(sample, _mm_loadu_pd(table+n*4))); \
+      high = _mm_add_pd(high, _mm_mul_pd(sample, _mm_loadu_pd(table+n*4+2))); \
+    }									\
+    _mm_storeu_pd(sums, low);						\
+    _mm_storeu_pd(sums+2, high);					\
+    finish_direct(analyzer, sums);					\
+  }
+
+#define DIRECT_KERNEL_AVX2(NAME, LENGTH)				\
+  __attribute__((target("avx2")))					\
+  void NAME(struct analyzer *analyzer, void *samples) {			\
+    const double *audio_samples = (double *)samples;			\
+    const double *table = analyzer->direct_table;			\
+    __m256d total = _mm256_setzero_pd();				\
+    double sums[4];							\
+    _Pragma("GCC unroll 64")						\
+    for (int n=0;n<LENGTH;n++) {					\
+      total = _mm256_add_pd(total, _mm256_mul_pd(_mm256_set1_pd(audio_samples[n]), \
+						 _mm256_loadu_pd(table+n*4))); \
+    }									\
+    _mm256_storeu_pd(sums, total);					\
+    finish_direct(analyzer, sums);					\
+  }
+#endif
+
+/* The same loop in single precision, and in fixed point. These don't
+   give exactly the same numbers as the doubles, but the table is laid
+   out the same way, so the compiler can still do four sums at once.
+   On an ARM chip, NEON can do that with floats and ints, but not
+   doubles. See init_low_precision() */
+#define DIRECT_KERNEL_FLOAT(NAME, LENGTH)				\
+  void NAME(struct analyzer *analyzer, void *samples) {			\
+    const float *audio_samples = (float *)samples;			\
+    const float *table = analyzer->float_table;				\
+    float sums[4] = { 0.0f, 0.0f, 0.0f, 0.0f };				\
+    _Pragma("GCC unroll 64")						\
+    for (int n=0;n<LENGTH;n++) {					\
+      for (int j=0;j<4;j++) {						\
+	sums[j] += audio_samples[n]*table[n*4+j];			\
+      }									\
+    }									\
+    for (int j=0;j<4;j++) {						\
+      analyzer->harmonics[1+j/2][j%2] = sums[j];			\
+    }									\
+  }
+
+#define DIRECT_KERNEL_FIXED(NAME, LENGTH)				\
+  void NAME(struct analyzer *analyzer, void *samples) {			\
+    const short *audio_samples = (short *)samples;			\
+    const short *table = analyzer->fixed_table;				\
+    int sums[4] = { 0, 0, 0, 0 };					\
+    _Pragma("GCC unroll 64")						\
+    for (int n=0;n<LENGTH;n++) {					\
+      for (int j=0;j<4;j++) {						\
+	sums[j] += (audio_samples[n]*table[n*4+j]) >> FIXED_SHIFT;	\
+      }									\
+    }									\
+    for (int j=0;j<4;j++) {						\
+      analyzer->harmonics[1+j/2][j%2] = sums[j]*FIXED_SCALE;		\
+    }									\
+  }
+
+/* A fixed point sum times this is the same size as the double one */
+#define FIXED_SCALE ((1 << FIXED_SHIFT)/(32768.0*32767.0))
+
+/* Every kernel comes in every flavor. The ones with numbers are for
+   44100, 48000, 22050 and 11025 samples per second. */
+#ifdef COSBY_X86
+#define DIRECT_KERNELS(N, LENGTH)				\
+  DIRECT_KERNEL(analyze_direct_##N, LENGTH)			\
+  DIRECT_KERNEL_SSE2(analyze_direct_sse2_##N, LENGTH)		\
+  DIRECT_KERNEL_AVX2(analyze_direct_avx2_##N, LENGTH)		\
+  DIRECT_KERNEL_FLOAT(analyze_direct_float_##N, LENGTH)		\
+  DIRECT_KERNEL_FIXED(analyze_direct_fixed_##N, LENGTH)
+#define DIRECT_KERNEL_ENTRY(N, WAVELENGTH)				\
+  { WAVELENGTH, { &analyze_direct_##N, &analyze_direct_sse2_##N,	\
+		  &analyze_direct_avx2_##N, &analyze_direct_avx2_##N },	\
+    &analyze_direct_float_##N, &analyze_direct_fixed_##N }
+#else
+#define DIRECT_KERNELS(N, LENGTH)				\
+  DIRECT_KERNEL(analyze_direct_##N, LENGTH)			\
+  DIRECT_KERNEL_FLOAT(analyze_direct_float_##N, LENGTH)		\
+  DIRECT_KERNEL_FIXED(analyze_direct_fixed_##N, LENGTH)
+#define DIRECT_KERNEL_ENTRY(N, WAVELENGTH)				\
+  { WAVELENGTH, { &analyze_direct_##N, &analyze_direct_##N,		\
+		  &analyze_direct_##N, &analyze_direct_##N },		\
+    &analyze_direct_float_##N, &analyze_direct_fixed_##N }
+#endif
+
+DIRECT_KERNELS(32, 32)
+DIRECT_KERNELS(35, 35)
+DIRECT_KERNELS(16, 16)
+DIRECT_KERNELS(8, 8)
+DIRECT_KERNELS(any, analyzer->wavelength)
+
+/* One for each SIMD level, and the low precision ones */
+struct direct_kernel {
+  size_t wavelength;
+  void (*analyze[4])(struct analyzer *analyzer, void *audio_samples);
+  void (*analyze_float)(struct analyzer *analyzer, void *audio_samples);
+  void (*analyze_fixed)(struct analyzer *analyzer, void *audio_samples);
+};
+
+const struct direct_kernel direct_kernels[] = {
+  DIRECT_KERNEL_ENTRY(32, 32),
+  DIRECT_KERNEL_ENTRY(35, 35),
+  DIRECT_KERNEL_ENTRY(16, 16),
+  DIRECT_KERNEL_ENTRY(8, 8),
+  DIRECT_KERNEL_ENTRY(any, 0)
+};
+
+/* SIMD versions of apply_window_func() and measure_harmonics(). The
+   window is just a lot of multiplies, which are the same one at a
+   time or eight at a time. The square roots are exact either way, so
+   these give exactly the same answers as the plain versions. Those
+   stay around as the reference, and for other CPUs. */
+#ifdef COSBY_X86
+__attribute__((target("sse2")))
+void apply_window_sse2(double *window, size_t wavelength, double *audio_samples, double *windowed_samples) {
+  size_t c = 0;
+  for (;c+2<=wavelength;c+=2) {
+    _mm_storeu_pd(windowed_samples+c,
+		  _mm_mul_pd(_mm_loadu_pd(audio_samples+c), _mm_loadu_pd(window+c)));
+  }
+  for (;c<wavelength;c++) {
+    windowed_samples[c] = audio_samples[c]*window[c];
+  }
+}
+
+__attribute__((target("avx2")))
+void apply_window_avx2(double *window, size_t wavelength, double *audio_samples, double *windowed_samples) {
+  size_t c = 0;
+  for (;c+4<=wavelength;c+=4) {
+    _mm256_storeu_pd(windowed_samples+c,
+		     _mm256_mul_pd(_mm256_loadu_pd(audio_samples+c), _mm256_loadu_pd(window+c)));
   }
+  for (;c<wavelength;c++) {
+    windowed_samples[c] = audio_samples[c]*window[c];
+  }
+}
+
+__attribute__((target("avx512f")))
+void apply_window_avx512(double *window, size_t wavelength, double *audio_samples, double *windowed_samples) {
+  size_t c = 0;
+  for (;c+8<=wavelength;c+=8) {
+    _mm512_storeu_pd(windowed_samples+c,
+		     _mm512_mul_pd(_mm512_loadu_pd(audio_samples+c), _mm512_loadu_pd(window+c)));
+  }
+  for (;c<wavelength;c++) {
+    windowed_samples[c] = audio_samples[c]*window[c];
+  }
+}
+
+/* Both harmonics at once. The first harmonic is on the bottom. */
+__attribute__((target("sse2")))
+void measure_harmonics_sse2(fftw_complex *harmonics, double *power_sq, double *power_diff) {
+  __m128d re = _mm_set_pd(harmonics[2][0], harmonics[1][0]);
+  __m128d im = _mm_set_pd(harmonics[2][1], harmonics[1][1]);
+  __m128d squares = _mm_add_pd(_mm_mul_pd(re, re), _mm_mul_pd(im, im));
+  double sq[2];
+  double power[2];
+  _mm_storeu_pd(sq, squares);
+  _mm_storeu_pd(power, _mm_sqrt_pd(squares));
+  (*power_sq) = sq[0]+sq[1];
+  (*power_diff) = power[0]-power[1];
+}
+#endif
+
+/* The widest SIMD instructions this CPU has */
+int detect_simd() {
+#ifdef COSBY_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+    return SIMD_AVX512;
+  if (__builtin_cpu_supports("avx2"))
+    return SIMD_AVX2;
+  if (__builtin_cpu_supports("sse2"))
+    return SIMD_SSE2;
+#endif
+  return SIMD_SCALAR;
+}
+
+const char *simd_name(int simd) {
+  const char *names[] = { "scalar", "SSE2", "AVX2", "AVX-512" };
+  return names[simd];
+}
+
+/* Single precision and fixed point.
+
+I use doubles because FFTW defaults to them, not because the decoder
+needs them. A cheap ARM board does floats a lot faster than doubles,
+and 16 bit ints faster still. So, the analyzer can work on a copy of
+the audio in floats or shorts instead. The FFT engine has a float
+version, and the direct engine has both. The sliding DFT keeps
+running sums, which don't take kindly to rounding, so it's doubles
+only.
+
+Only the two harmonics that come out the other end get turned back
+into doubles. measure_harmonics() and the back end only do a handful
+of math per sample, so they stay the way they are. */
+
+/* Turns doubles between -1 and 1 into whatever the analyzer wants */
+static inline short fixed_sample(double sample) {
+  sample *= 32768.0;
+  if (sample >= 32767.0)
+    return 32767;
+  if (sample <= -32768.0)
+    return -32768;
+  return (short)lrint(sample);
+}
+
+void convert_samples(int precision, const double *samples, void *out, size_t count) {
+  if (precision == PRECISION_FLOAT) {
+    for (size_t c=0;c<count;c++) {
+      ((float *)out)[c] = (float)samples[c];
+    }
+  } else if (precision == PRECISION_FIXED) {
+    for (size_t c=0;c<count;c++) {
+      ((short *)out)[c] = fixed_sample(samples[c]);
+    }
+  }
+}
+
+void analyze_fft_float(struct analyzer *analyzer, void *samples) {
+  float *audio_samples = (float *)samples;
+  for (int c=0;c<analyzer->wavelength;c++) {
+    analyzer->float_samples[c] = audio_samples[c]*analyzer->float_window[c];
+  }
+  fftwf_execute(analyzer->get_float_frequencies);
+  for (int k=1;k<=2;k++) {
+    analyzer->harmonics[k][0] = analyzer->float_harmonics[k][0];
+    analyzer->harmonics[k][1] = analyzer->float_harmonics[k][1];
+  }
+}
+
+/* Whether we've made a plan that measured anything. Plans that just
+   guess don't make any wisdom worth saving. See save_wisdom_file() */
+int measured_plan = 0;
+
+/* The FFTW planner flag for one of the PLAN_ definitions */
+unsigned plan_flags(int plan) {
+  if (plan != PLAN_ESTIMATE)
+    measured_plan = 1;
+  if (plan == PLAN_PATIENT)
+    return FFTW_PATIENT;
+  if (plan == PLAN_MEASURE)
+    return FFTW_MEASURE;
+  return FFTW_ESTIMATE;
+}
+
+/* Rounds the window and the direct engine's table off to floats and
+   to 16 bits. The table's numbers are all between -1 and 1. */
+int init_low_precision(struct analyzer *analyzer, int plan) {
+  size_t wavelength = analyzer->wavelength;
+
+  if (analyzer->precision == PRECISION_FLOAT) {
+    analyzer->float_window = malloc(sizeof(float)*wavelength);
+    analyzer->float_samples = (float*) fftwf_malloc(sizeof(float)*wavelength);
+    analyzer->float_harmonics = (fftwf_complex*) fftwf_malloc(sizeof(fftwf_complex)*(wavelength/2+1));
+    analyzer->float_table = malloc(sizeof(float)*4*wavelength);
+    if (analyzer->float_window == NULL || analyzer->float_samples == NULL ||
+	analyzer->float_harmonics == NULL || analyzer->float_table == NULL)
+      return 1;
+    for (int c=0;c<wavelength;c++) {
+      analyzer->float_window[c] = (float)analyzer->window[c];
+    }
+    for (int c=0;c<4*wavelength;c++) {
+      analyzer->float_table[c] = (float)analyzer->direct_table[c];
+    }
+    pthread_mutex_lock(&planner_lock);
+    analyzer->get_float_frequencies = fftwf_plan_dft_r2c_1d(wavelength,
+							    analyzer->float_samples,
+							    analyzer->float_harmonics,
+							    plan_flags(plan) | FFTW_DESTROY_INPUT);
+    pthread_mutex_unlock(&planner_lock);
+  } else if (analyzer->precision == PRECISION_FIXED) {
+    analyzer->fixed_table = malloc(sizeof(short)*4*wavelength);
+    if (analyzer->fixed_table == NULL)
+      return 1;
+    for (int c=0;c<4*wavelength;c++) {
+      analyzer->fixed_table[c] = (short)lrint(analyzer->direct_table[c]*32767.0);
+    }
+  }
+  return 0;
+}
+
+/* Sets up an analyzer for the engine. The next window it sees should
+   start at offset in the recording.
+
+   If the FFT is over the wavelength of the low frequency (twice the symbol size)
+
+   sample 0 - DC
+   sample 1 - wavelen of 2 symbols - "Zero"
+   sample 2 - wavelen of 1 symbol - "One"
+
+   This doesn't have a very narrow filter, so it might be susceptable
+   to interference.
+
+   FFTW's planner isn't thread safe, so only call this from the main
+   thread. Measuring writes all over the arrays the plans use, so it
+   has to happen before anything goes in them. */
+int init_analyzer(struct analyzer *analyzer, double *window, size_t wavelength,
+		  int engine, int precision, int simd, int plan, size_t offset) {
+  size_t num_harmonics = wavelength/2+1;
+  int fft_size = wavelength;
+  int double_plan;
+
+  analyzer->window = window;
+  analyzer->wavelength = wavelength;
+  analyzer->precision = precision;
+  analyzer->float_window = NULL;
+  analyzer->float_samples = NULL;
+  analyzer->float_harmonics = NULL;
+  analyzer->float_table = NULL;
+  analyzer->fixed_table = NULL;
+  analyzer->direct_table = NULL;
+  analyzer->harmonics = NULL;
+  analyzer->windowed_samples = NULL;
+  analyzer->get_frequencies = NULL;
+  analyzer->get_many_frequencies = NULL;
+  analyzer->get_float_frequencies = NULL;
+  analyzer->stats = NULL;
+  analyzer->apply_window = &apply_window_func;
+  analyzer->measure = &measure_harmonics;
+#ifdef COSBY_X86
+  if (simd >= SIMD_SSE2) {
+    analyzer->apply_window = &apply_window_sse2;
+    analyzer->measure = &measure_harmonics_sse2;
+  }
+  if (simd >= SIMD_AVX2)
+    analyzer->apply_window = &apply_window_avx2;
+  if (simd >= SIMD_AVX512)
+    analyzer->apply_window = &apply_window_avx512;
+#endif
+
+  /* Fixed point only has the direct engine, and the sliding DFT only
+     works in doubles */
+  if ((precision == PRECISION_FIXED && engine != ENGINE_DIRECT) ||
+      (precision == PRECISION_FLOAT && engine == ENGINE_SDFT))
+    engine = ENGINE_DIRECT;
+
+  /* The other engines never run these plans, so there's no point
+     measuring them */
+  if (engine != ENGINE_FFT)
+    plan = PLAN_ESTIMATE;
+  analyzer->engine = engine;
+
+  /* Only the FFT engine in doubles needs room for more than one
+     window, or the double plans at all */
+  analyzer->batch = 1;
+  double_plan = PLAN_ESTIMATE;
+  if (engine == ENGINE_FFT && precision == PRECISION_DOUBLE) {
+    analyzer->batch = FFT_BATCH_SIZE;
+    double_plan = plan;
+  }
+  analyzer->harmonics = (fftw_complex*) fftw_malloc(sizeof(fftw_complex)*num_harmonics*
+						    analyzer->batch);
+  analyzer->windowed_samples = (double*) fftw_malloc(sizeof(double)*wavelength*
+						     analyzer->batch);
+  if (analyzer->harmonics == NULL || analyzer->windowed_samples == NULL)
+    return 1;
+  pthread_mutex_lock(&planner_lock);
+  analyzer->get_frequencies = fftw_plan_dft_r2c_1d(wavelength,
+						   analyzer->windowed_samples,
+						   analyzer->harmonics,
+						   plan_flags(double_plan) | FFTW_DESTROY_INPUT);
+  analyzer->get_many_frequencies = fftw_plan_many_dft_r2c(1, &fft_size,
+							  analyzer->batch,
+							  analyzer->windowed_samples, NULL,
+							  1, wavelength,
+							  analyzer->harmonics, NULL,
+							  1, num_harmonics,
+							  plan_flags(double_plan) | FFTW_DESTROY_INPUT);
+  pthread_mutex_unlock(&planner_lock);
+  if (analyzer->get_frequencies == NULL || analyzer->get_many_frequencies == NULL)
+    return 1;
+  analyzer->analyze_block = &analyze_each;
+
+  if (engine == ENGINE_DIRECT || precision != PRECISION_DOUBLE) {
+    if (init_direct(analyzer) || init_low_precision(analyzer, plan))
+      return 1;
+  }
+  if (engine == ENGINE_SDFT) {
+    analyzer->analyze = &analyze_sdft;
+    init_sdft(analyzer);
+    analyzer->sdft_count = offset;
+  } else if (engine == ENGINE_DIRECT) {
+    /* Use the loop made for this wavelength, if there is one */
+    for (int c=0;;c++) {
+      if (direct_kernels[c].wavelength == wavelength ||
+	  direct_kernels[c].wavelength == 0) {
+	if (precision == PRECISION_FLOAT)
+	  analyzer->analyze = direct_kernels[c].analyze_float;
+	else if (precision == PRECISION_FIXED)
+	  analyzer->analyze = direct_kernels[c].analyze_fixed;
+	else
+	  analyzer->analyze = direct_kernels[c].analyze[simd];
+	break;
+      }
+    }
+  } else if (precision == PRECISION_FLOAT) {
+    analyzer->analyze = &analyze_fft_float;
+  } else {
+    analyzer->analyze_block = &analyze_fft;
+  }
+  return 0;
+}
+
+/* This works on an analyzer that init_analyzer() only got partway
+   through, too */
+void free_analyzer(struct analyzer *analyzer) {
+  pthread_mutex_lock(&planner_lock);
+  if (analyzer->get_frequencies != NULL)
+    fftw_destroy_plan(analyzer->get_frequencies);
+  if (analyzer->get_many_frequencies != NULL)
+    fftw_destroy_plan(analyzer->get_many_frequencies);
+  if (analyzer->get_float_frequencies != NULL)
+    fftwf_destroy_plan(analyzer->get_float_frequencies);
+  pthread_mutex_unlock(&planner_lock);
+  fftw_free(analyzer->harmonics);
+  fftw_free(analyzer->windowed_samples);
+  free(analyzer->direct_table);
+  fftwf_free(analyzer->float_samples);
+  fftwf_free(analyzer->float_harmonics);
+  free(analyzer->float_window);
+  free(analyzer->float_table);
+  free(analyzer->fixed_table);
 }
 
 
@@ -653,6 +2028,18 @@ file by hand.
 
    ======================================================= */
 
+/* Hands over the bytes we've saved up */
+void flush_decoder_output(struct cosby_decoder *decoder) {
+  if (decoder->out_count > 0 && decoder->on_bytes != NULL)
+    decoder->on_bytes(decoder->user, decoder->out, decoder->out_count);
+  decoder->out_count = 0;
+}
+
+void decoder_event(struct cosby_decoder *decoder, int event) {
+  if (decoder->on_event != NULL)
+    decoder->on_event(decoder->user, event, decoder->offset);
+}
+
 /* When cosby sees a "zero" or a "one" in the input,
    it calls this function, which translates it into
    bytes. 
@@ -662,95 +2049,114 @@ file by hand.
 
    Actual tapes contain about five full seconds of zeros
    at the start. */
-void process_bit(int bit, FILE *out_file) {
-  static char val = 0;
-  static int count = 0;
-  static int initzeros = 0;
-  static int initones = 0;
-  if (framed) {
+void process_bit(struct cosby_decoder *decoder, int bit) {
+  if (decoder->framed) {
     /* cosby_print_err("%d!!\n",bit); */
-    count++;
-    val *= 2;
-    val += bit;
-    if (count == 8) {
-      fwrite(&val,1,1,out_file);
-      /*  Uncomment this so hitting CTRL-C to stop recording works. */
-      /* fflush(out_file); */
-      count = 0;
-      val = 0;
+    decoder->count++;
+    decoder->val *= 2;
+    decoder->val += bit;
+    if (decoder->stats != NULL)
+      decoder->stats->bits++;
+    if (decoder->count == 8) {
+      if (decoder->stats != NULL)
+	decoder->stats->bytes++;
+      decoder->out[decoder->out_count++] = decoder->val;
+      if (decoder->out_count == DECODER_OUTPUT_SIZE)
+	flush_decoder_output(decoder);
+      decoder->count = 0;
+      decoder->val = 0;
     }
   } else {
-    if (initzeros < 8) {
+    if (decoder->initzeros < 8) {
       if (bit == 0)
-	initzeros++;
+	decoder->initzeros++;
       else
-	initzeros = 0;
+	decoder->initzeros = 0;
     } else {
       if (bit == 1) {
-	initones++;
-	if (initones == 8) {
-	  framed = 1;
-	  cosby_print("Got a signal!\n");
+	decoder->initones++;
+	if (decoder->initones == 8) {
+	  if (decoder->stats != NULL)
+	    decoder->stats->records++;
+	  decoder->framed = 1;
+	  decoder_event(decoder, COSBY_EVENT_FRAMED);
 	}
-      } else if (initones>0) {
-	initones = 0;
-	initzeros = 1;
+      } else if (decoder->initones>0) {
+	decoder->initones = 0;
+	decoder->initzeros = 1;
       }
     }
   }
 }
 
-/* This is where all the magic happens. This is called once
-   per sample. Since the FFT is performed over an entire wavelength,
-   it's probably overkill. */
-int process_harmonics(fftw_complex *harmonics, size_t num_harmonics, FILE *out_file) {
-  static int current_symbol = 1; /* The bit symbol we're currently looking at */
-  static int sample_count = 0; /* Samples we've seen in this symbol */
-  double ave_power_diff = 0.0;
-  double ave_power_total_sq = 0.0;
-
-  power_sq_totals[power_sq_totals_pos++] = (harmonics[1][0]*harmonics[1][0]+
-					    harmonics[1][1]*harmonics[1][1]+
-			    (harmonics[2][0]*harmonics[2][0]+
-			     harmonics[2][1]*harmonics[2][1]));
-  if (power_sq_totals_pos >= POWER_SQ_TOTALS_SIZE*DEFAULT_SYMBOL_LENGTH) {
-    for (int c=0;c<POWER_SQ_TOTALS_SIZE*DEFAULT_SYMBOL_LENGTH;c++)
-      ave_power_total_sq += power_sq_totals[c]/(POWER_SQ_TOTALS_SIZE*DEFAULT_SYMBOL_LENGTH);
-    if (framed) {
-      if (ave_signal_power_sq == 0.0) {
-	ave_signal_power_sq = ave_power_total_sq;
+/* Starts looking for the next lot of data, with a clean slate */
+void rearm_decoder(struct cosby_decoder *decoder) {
+  decoder->framed = 0;
+  decoder->initzeros = 0;
+  decoder->initones = 0;
+  decoder->count = 0;
+  decoder->val = 0;
+  decoder->ave_signal_power_sq = 0.0;
+  decoder->signal_power_total = 0.0;
+  decoder->signal_power_count = 0;
+}
+
+/* Keeps track of how strong the signal is, and decides when it's
+   gone. Returns 1 once it is. */
+int signal_gone(struct cosby_decoder *decoder, double power_sq) {
+  double ave_power_total_sq;
+
+  if (block_mean_add(&decoder->power_sq_totals, power_sq, &ave_power_total_sq)) {
+    if (decoder->framed) {
+      if (decoder->ave_signal_power_sq == 0.0) {
+	decoder->ave_signal_power_sq = ave_power_total_sq;
 	/* cosby_print_err("Power: %f\n",ave_power_total_sq); */
-	/* SIGNAL_POWER_RANGE needs to be sqaured to compare
+	/* The signal range needs to be sqaured to compare
 	   sqaured powers */
-      } else if (ave_power_total_sq*SIGNAL_POWER_RANGE*SIGNAL_POWER_RANGE < ave_signal_power_sq) {
+      } else if (ave_power_total_sq*decoder->settings.signal_range*decoder->settings.signal_range <
+		 decoder->ave_signal_power_sq) {
+	flush_decoder_output(decoder);
+	if (decoder->settings.keep_going) {
+	  decoder_event(decoder, COSBY_EVENT_DONE);
+	  rearm_decoder(decoder);
+	  return 0;
+	}
+	decoder->done = 1;
+	decoder_event(decoder, COSBY_EVENT_DONE);
 	return 1;
       }
+      decoder->signal_power_total += ave_power_total_sq;
+      decoder->signal_power_count++;
     }
-    power_sq_totals_pos = 0;
   }
-  power_diffs[power_diffs_start++] = sqrt(harmonics[1][0]*harmonics[1][0]+harmonics[1][1]*harmonics[1][1])-
-    sqrt(harmonics[2][0]*harmonics[2][0]+harmonics[2][1]*harmonics[2][1]);
-  if (power_diffs_start>=DEFAULT_SYMBOL_LENGTH/2)
-    power_diffs_start = 0;
-
-  sample_count++;
+  return 0;
+}
 
-  for (int c=0;c<DEFAULT_SYMBOL_LENGTH/2;c++) {
-    ave_power_diff+=power_diffs[c];
-  }
-  ave_power_diff/=DEFAULT_SYMBOL_LENGTH/2;
+/* This is where all the magic happens. This is called once
+   per sample, in order. Since the FFT is performed over an entire
+   wavelength, it's probably overkill. */
+int process_power(struct cosby_decoder *decoder, double power_sq, double power_diff) {
+  double ave_power_diff;
 
-  if (current_symbol == 1 && ave_power_diff > 0.0) {
-    current_symbol = 0;
-    sample_count = 0;
-    process_bit(0, out_file);
-  } else if (current_symbol == 0 && ave_power_diff < 0.0) {
-    current_symbol = 1;
-    sample_count = 0;
-    process_bit(1, out_file);
-  }  else if (sample_count > (int)(1.5*DEFAULT_SYMBOL_LENGTH)) {
-    process_bit(current_symbol, out_file);
-    sample_count -= DEFAULT_SYMBOL_LENGTH;
+  if (signal_gone(decoder, power_sq))
+    return 1;
+  running_sum_add(&decoder->power_diffs, power_diff);
+
+  decoder->sample_count++;
+
+  ave_power_diff = running_sum_mean(&decoder->power_diffs);
+
+  if (decoder->current_symbol == 1 && ave_power_diff > decoder->threshold) {
+    decoder->current_symbol = 0;
+    decoder->sample_count = 0;
+    process_bit(decoder, 0);
+  } else if (decoder->current_symbol == 0 && ave_power_diff < decoder->threshold) {
+    decoder->current_symbol = 1;
+    decoder->sample_count = 0;
+    process_bit(decoder, 1);
+  }  else if (decoder->sample_count > decoder->repeat_after) {
+    process_bit(decoder, decoder->current_symbol);
+    decoder->sample_count -= decoder->symbol_time;
   }
   return 0;
 }
@@ -759,254 +2165,2805 @@ int process_harmonics(fftw_complex *harmonics, size_t num_harmonics, FILE *out_f
 window function) one wave long. It may be possible to use a correctly
 tuned Doplh-Chebyshev or some other foreign name to get better
 performance. */
-int init_window() {
-  window = (double*)fftw_malloc(sizeof(double)*DEFAULT_WAVELENGTH);
+double *make_window(size_t wavelength) {
+  double *window = (double*)fftw_malloc(sizeof(double)*wavelength);
   if (window == NULL)
-    return 1;
-  for (int c=0;c<DEFAULT_WAVELENGTH;c++) {
-    window[c] = cos(c/(DEFAULT_WAVELENGTH-1.0)*PI-PI/2);
+    return NULL;
+  for (int c=0;c<wavelength;c++) {
+    window[c] = cos(c/(wavelength-1.0)*PI-PI/2);
   }
-  return 0;
+  return window;
 }
 
-/* The arrays of power differences and totals */
-int init_history() {
-  power_diffs = fftw_malloc(sizeof(double)*(DEFAULT_SYMBOL_LENGTH/2));
-  if (power_diffs == NULL)
-    return 1;
-  for (int c=0;c<DEFAULT_SYMBOL_LENGTH/2;c++) {
-    power_diffs[c] = 0.0;
+/* This is a circular buffer. That means, if you reach the end,
+you just start again at the beginning.
+
+The trick is that the buffer is in memory twice, right next to
+itself. We ask the kernel to map the same pages into two places back
+to back, so writing to one copy writes to both. Reading off the end
+of the first copy just keeps going into the start of the second,
+which is the start of the buffer. Any stretch of the buffer is one
+plain old array, even when it wraps around, and nobody has to copy
+anything.
+
+This makes one with room for at least *size things element_size
+bytes long, and sets *size to how many it really has room for. */
+void *map_mirrored(size_t *size, size_t element_size) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t bytes;
+  char *place;
+  int fd;
+
+  /* Both copies have to start on a page */
+  bytes = ((*size)*element_size+page-1)/page*page;
+  (*size) = bytes/element_size;
+
+  if ((fd = memfd_create("cosby", 0)) < 0)
+    return NULL;
+  if (ftruncate(fd, bytes) < 0) {
+    close(fd);
+    return NULL;
+  }
+
+  /* Grab enough address space for both copies, then put the pages
+     into each half */
+  place = mmap(NULL, 2*bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (place == MAP_FAILED) {
+    close(fd);
+    return NULL;
+  }
+  if (mmap(place, bytes, PROT_READ | PROT_WRITE,
+	   MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+      mmap(place+bytes, bytes, PROT_READ | PROT_WRITE,
+	   MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    munmap(place, 2*bytes);
+    close(fd);
+    return NULL;
+  }
+
+  /* The mappings hang on to the memory, so we don't need this */
+  close(fd);
+  return (void *)place;
+}
+
+void unmap_mirrored(void *buffer, size_t size, size_t element_size) {
+  munmap(buffer, 2*size*element_size);
+}
+
+size_t greatest_common_divisor(size_t a, size_t b) {
+  size_t t;
+  while (b != 0) {
+    t = a%b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+/* Sets up a resampler from one sample rate to another.
+
+   The decoder doesn't need anywhere near 44100 samples per second to
+   hear a 2756Hz tone. 11025 is plenty. Every sample it doesn't get is
+   one less window to look at, so turning the rate down makes it a lot
+   faster. And, recordings come in at 48000 or 96000 anyway.
+
+   To change the rate by up/down, you can pretend to stick up-1 zeros
+   between every input sample, smooth that out with a low pass filter,
+   then keep every down'th sample. The filter gets rid of anything
+   that won't fit at the new rate, so it doesn't fold over into
+   something that sounds like our frequencies.
+
+   Most of that is a waste of time. The zeros don't add anything to
+   the filter, and we throw away most of what it makes. So, the filter
+   gets chopped up into up smaller filters (the "phases"), each one
+   only touching real input samples. Each output sample just runs the
+   one phase that lines up with it. That's a polyphase resampler. */
+int init_resampler(struct resampler *resampler, size_t from_rate, size_t to_rate) {
+  size_t gcd = greatest_common_divisor(from_rate, to_rate);
+  size_t length;
+  double cutoff, center, x, value, total = 0.0;
+  double *filter;
+
+  resampler->up = to_rate/gcd;
+  resampler->down = from_rate/gcd;
+  resampler->taps = RESAMPLER_TAPS*((resampler->down+resampler->up-1)/resampler->up);
+  length = resampler->up*resampler->taps;
+  resampler->filters = malloc(sizeof(double)*length);
+  resampler->history = calloc(2*resampler->taps, sizeof(double));
+  filter = malloc(sizeof(double)*length);
+  if (resampler->filters == NULL || resampler->history == NULL || filter == NULL) {
+    free(filter);
+    return 1;
+  }
+
+  /* A sinc function low pass filter, with a Blackman window so it
+     doesn't ring. cutoff is in cycles per sample, at the rate with
+     all the zeros stuck in. */
+  cutoff = RESAMPLER_CUTOFF*(from_rate < to_rate ? from_rate : to_rate)/
+    ((double)from_rate*resampler->up);
+  center = (length-1)/2.0;
+  for (int c=0;c<length;c++) {
+    x = 2.0*PI*cutoff*(c-center);
+    value = (x == 0.0) ? 1.0 : sin(x)/x;
+    value *= 0.42-0.5*cos(2.0*PI*c/(length-1))+0.08*cos(4.0*PI*c/(length-1));
+    filter[c] = value;
+    total += value;
+  }
+
+  /* Every phase gets every up'th tap, backwards, so it lines up with
+     the history. The zeros we didn't stick in would have made it up
+     times quieter, so make up for it. */
+  for (int c=0;c<length;c++) {
+    resampler->filters[(c%resampler->up)*resampler->taps+
+		       resampler->taps-1-c/resampler->up] = filter[c]*resampler->up/total;
+  }
+  free(filter);
+  resampler->count = 0;
+  resampler->next = 0;
+  resampler->phase = 0;
+  return 0;
+}
+
+void free_resampler(struct resampler *resampler) {
+  free(resampler->filters);
+  free(resampler->history);
+}
+
+/* Resamples count input samples into at most room output samples.
+   Returns how many output samples it made, and sets *used to how many
+   input samples it got through. If it runs out of room, pass it the
+   rest of the input next time. */
+size_t resample(struct resampler *resampler, const double *samples, size_t count,
+		double *out, size_t room, size_t *used) {
+  size_t taps = resampler->taps;
+  size_t made = 0;
+  size_t pos;
+  double *filter;
+  double *history;
+  double total;
+
+  for (size_t c=0;c<count;c++) {
+    /* Every input sample goes in twice, so the last taps of them are
+       always in a row at history+pos+1 */
+    pos = resampler->count%taps;
+    resampler->history[pos] = samples[c];
+    resampler->history[pos+taps] = samples[c];
+
+    /* Make every output sample that lines up with this input sample.
+       Going down in rate, that's usually none. */
+    while (resampler->next == resampler->count) {
+      if (made == room) {
+	(*used) = c;
+	return made;
+      }
+      filter = resampler->filters+resampler->phase*taps;
+      history = resampler->history+pos+1;
+      total = 0.0;
+      for (int n=0;n<taps;n++) {
+	total += filter[n]*history[n];
+      }
+      out[made++] = total;
+      resampler->phase += resampler->down;
+      resampler->next += resampler->phase/resampler->up;
+      resampler->phase %= resampler->up;
+    }
+    resampler->count++;
+  }
+  (*used) = count;
+  return made;
+}
+
+/* The power of one wave of the "0" frequency at full scale, the way
+   measure_harmonics() works it out */
+double full_scale_power(double *window, size_t wavelength) {
+  double sums[2][2] = { { 0.0, 0.0 }, { 0.0, 0.0 } };
+  double sample;
+  for (int n=0;n<wavelength;n++) {
+    sample = cos(2.0*PI*n/wavelength)*window[n];
+    for (int k=1;k<=2;k++) {
+      sums[k-1][0] += sample*cos(2.0*PI*k*n/wavelength);
+      sums[k-1][1] -= sample*sin(2.0*PI*k*n/wavelength);
+    }
+  }
+  return (sums[0][0]*sums[0][0]+sums[0][1]*sums[0][1]+
+	  sums[1][0]*sums[1][0]+sums[1][1]*sums[1][1]);
+}
+
+COSBY_API void cosby_settings_init(struct cosby_settings *settings) {
+  settings->engine = DEFAULT_ENGINE;
+  settings->input_rate = DEFAULT_SAMPLE_RATE;
+  settings->rate = DEFAULT_SAMPLE_RATE;
+  settings->simd = SIMD_AVX512;
+  settings->precision = PRECISION_DOUBLE;
+  settings->plan = PLAN_ESTIMATE;
+  settings->timing = TIMING_SAMPLE;
+  settings->skip_quiet = 1;
+  settings->keep_going = 0;
+  settings->signal_range = SIGNAL_POWER_RANGE;
+  settings->power_average = POWER_SQ_TOTALS_SIZE;
+  settings->threshold = SLICE_THRESHOLD;
+  settings->repeat_after = REPEAT_AFTER;
+}
+
+/* FFTW's wisdom.
+
+FFTW_ESTIMATE guesses how to do a transform from its size.
+FFTW_MEASURE actually tries a bunch of ways and times them, which
+takes a while, but FFTW remembers the answer. It calls that wisdom,
+and it can be saved and loaded. Once it's loaded, planning a
+transform of the same size and kind comes right out of the wisdom,
+even with FFTW_ESTIMATE.
+
+Doubles and floats have their own wisdom. The file has both, one
+after the other. */
+
+/* The wisdom as of the last time we loaded or saved it, so we know
+   whether there's anything new to save */
+char *known_wisdom = NULL;
+
+char *export_wisdom() {
+  char *wisdom;
+  char *float_wisdom;
+  char *both = NULL;
+  pthread_mutex_lock(&planner_lock);
+  wisdom = fftw_export_wisdom_to_string();
+  float_wisdom = fftwf_export_wisdom_to_string();
+  pthread_mutex_unlock(&planner_lock);
+  if (wisdom != NULL && float_wisdom != NULL) {
+    both = malloc(strlen(wisdom)+strlen(float_wisdom)+1);
+    if (both != NULL) {
+      strcpy(both, wisdom);
+      strcat(both, float_wisdom);
+    }
+  }
+  fftw_free(wisdom);
+  fftwf_free(float_wisdom);
+  return both;
+}
+
+COSBY_API int cosby_load_wisdom(const char *filename) {
+  FILE *file;
+  char *text;
+  char *float_wisdom;
+  long size;
+  int result = 0;
+
+  file = fopen(filename, "r");
+  if (file == NULL) {
+    /* There's nothing to load, so nothing we have is new yet */
+    if (known_wisdom == NULL)
+      known_wisdom = export_wisdom();
+    return 1;
+  }
+  if (fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) < 0 ||
+      fseek(file, 0, SEEK_SET) != 0 || (text = malloc(size+1)) == NULL) {
+    fclose(file);
+    return 1;
+  }
+  size = fread(text, 1, size, file);
+  fclose(file);
+  text[size] = 0;
+
+  /* The float wisdom starts with "(fftw-3.3.10 fftwf_wisdom" */
+  pthread_mutex_lock(&planner_lock);
+  float_wisdom = strstr(text, " fftwf_wisdom");
+  if (float_wisdom != NULL) {
+    while (float_wisdom > text && (*float_wisdom) != '(')
+      float_wisdom--;
+    if (!fftwf_import_wisdom_from_string(float_wisdom))
+      result = 1;
+    (*float_wisdom) = 0;
+  }
+  if (!fftw_import_wisdom_from_string(text))
+    result = 1;
+  pthread_mutex_unlock(&planner_lock);
+  free(text);
+
+  free(known_wisdom);
+  known_wisdom = export_wisdom();
+  return result;
+}
+
+COSBY_API int cosby_save_wisdom(const char *filename) {
+  char *wisdom = export_wisdom();
+  char *temp;
+  FILE *file;
+  int result = 1;
+
+  if (wisdom == NULL)
+    return 1;
+  if (known_wisdom != NULL && 0==strcmp(wisdom, known_wisdom)) {
+    free(wisdom);
+    return 0;
+  }
+
+  /* Write it somewhere else and move it into place, so anybody
+     loading it at the same time never sees half a file */
+  temp = malloc(strlen(filename)+32);
+  if (temp != NULL) {
+    sprintf(temp, "%s.%ld", filename, (long)getpid());
+    file = fopen(temp, "w");
+    if (file != NULL) {
+      result = (fputs(wisdom, file) < 0);
+      if (fclose(file) != 0)
+	result = 1;
+      if (result == 0 && rename(temp, filename) != 0)
+	result = 1;
+      if (result != 0)
+	unlink(temp);
+    }
+    free(temp);
+  }
+  if (result == 0) {
+    free(known_wisdom);
+    known_wisdom = wisdom;
+  } else {
+    free(wisdom);
+  }
+  return result;
+}
+
+COSBY_API struct cosby_decoder *cosby_decoder_new(const struct cosby_settings *settings,
+						  cosby_bytes_callback on_bytes,
+						  cosby_event_callback on_event,
+						  void *user) {
+  struct cosby_decoder *decoder;
+  size_t size;
+  int engine;
+  if (settings->rate < MIN_SAMPLE_RATE || settings->input_rate <= 0 ||
+      settings->signal_range <= 1.0 || settings->power_average < 1.0 ||
+      settings->repeat_after <= 1.0)
+    return NULL;
+
+  /* Fixed point sums only have room for so long a window */
+  if (settings->precision == PRECISION_FIXED &&
+      (size_t)(settings->rate/(double)ZERO_FREQ+0.5) > FIXED_MAX_WAVELENGTH)
+    return NULL;
+  decoder = calloc(1, sizeof(struct cosby_decoder));
+  if (decoder == NULL)
+    return NULL;
+  decoder->settings = (*settings);
+
+  /* The sliding DFT has to see every sample, and symbol timing
+     skips most of them */
+  engine = settings->engine;
+  if (settings->timing == TIMING_SYMBOL && engine == ENGINE_SDFT)
+    engine = ENGINE_DIRECT;
+
+  /* Use the widest SIMD instructions we're allowed to that the CPU
+     has */
+  decoder->simd = detect_simd();
+  if (decoder->simd > settings->simd)
+    decoder->simd = settings->simd;
+  if (decoder->simd < SIMD_SCALAR)
+    decoder->simd = SIMD_SCALAR;
+
+  decoder->wavelength = (size_t)(settings->rate/(double)ZERO_FREQ+0.5);
+  decoder->symbol_length = (size_t)((settings->rate/(double)ZERO_FREQ)/2.0+0.5);
+
+  /* A long run of the same bit is timed by counting symbols. At 44100
+     a symbol is 16 samples, give or take a hair, and that's what we
+     count. At 16000 it's 5.8, and counting 6 drifts off by a whole
+     symbol in 30 bits. So, unless it's close to a whole number, we
+     keep track of the fractions. */
+  decoder->symbol_time = (settings->rate/(double)ZERO_FREQ)/2.0;
+  if (fabs(decoder->symbol_time-decoder->symbol_length) < 0.001*decoder->symbol_time)
+    decoder->symbol_time = decoder->symbol_length;
+
+  /* If nothing changes for a symbol and a half, it's the same bit
+     again. At 44100, one sample is a sixteenth of a symbol, and
+     waiting for the sample after that is close enough. Down around
+     11025, one sample is a quarter of a symbol, and waiting one more
+     leaves hardly any room for the next change to come a little
+     early. So there, we go with whichever sample is closest. */
+  if (decoder->symbol_length >= DEFAULT_WAVELENGTH/2)
+    decoder->repeat_after = (int)(settings->repeat_after*decoder->symbol_time);
+  else
+    decoder->repeat_after = (int)(settings->repeat_after*decoder->symbol_time+0.5)-1;
+  decoder->audio_buffer_size = AUDIO_BUFFER_SIZE;
+  decoder->audio_buffer = map_mirrored(&decoder->audio_buffer_size, sizeof(double));
+  decoder->work_buffer = decoder->audio_buffer;
+  decoder->sample_size = precision_size(settings->precision);
+  if (settings->precision != PRECISION_DOUBLE) {
+    /* The same number of samples, so they line up */
+    size = decoder->audio_buffer_size;
+    decoder->work_buffer = map_mirrored(&size, decoder->sample_size);
+    if (decoder->work_buffer != NULL && size != decoder->audio_buffer_size) {
+      unmap_mirrored(decoder->work_buffer, size, decoder->sample_size);
+      decoder->work_buffer = NULL;
+    }
+  }
+  decoder->window = make_window(decoder->wavelength);
+  if (decoder->audio_buffer == NULL || decoder->work_buffer == NULL ||
+      decoder->window == NULL ||
+      init_analyzer(&decoder->analyzer, decoder->window, decoder->wavelength,
+		    engine, settings->precision, decoder->simd,
+		    settings->plan, 0) ||
+      running_sum_init(&decoder->power_diffs, decoder->symbol_length/2)) {
+    cosby_decoder_free(decoder);
+    return NULL;
+  }
+  if (settings->input_rate != settings->rate) {
+    decoder->resampler = calloc(1, sizeof(struct resampler));
+    decoder->staging = malloc(sizeof(double)*AUDIO_READ_SIZE);
+    if (decoder->resampler == NULL || decoder->staging == NULL ||
+	init_resampler(decoder->resampler, settings->input_rate, settings->rate)) {
+      cosby_decoder_free(decoder);
+      return NULL;
+    }
+  }
+  /* Symbol timing only sees one window per symbol */
+  if (settings->timing == TIMING_SYMBOL)
+    block_mean_init(&decoder->power_sq_totals, (size_t)settings->power_average);
+  else
+    block_mean_init(&decoder->power_sq_totals,
+		    (size_t)(settings->power_average*decoder->symbol_length));
+  decoder->current_symbol = 1;
+  decoder->symbol_period = decoder->symbol_time;
+  decoder->quiet_block = (size_t)-1;
+  decoder->full_scale_power_sq = full_scale_power(decoder->window, decoder->wavelength);
+  decoder->threshold = settings->threshold*sqrt(decoder->full_scale_power_sq);
+  if (settings->skip_quiet &&
+      init_analyzer(&decoder->probe, decoder->window, decoder->wavelength,
+		    ENGINE_DIRECT, PRECISION_DOUBLE, decoder->simd, PLAN_ESTIMATE, 0)) {
+    cosby_decoder_free(decoder);
+    return NULL;
+  }
+  decoder->on_bytes = on_bytes;
+  decoder->on_event = on_event;
+  decoder->user = user;
+  return decoder;
+}
+
+/* cosby_decoder_new() cleans up with this when it can't finish, so
+   anything it didn't get to yet is still zeros */
+COSBY_API void cosby_decoder_free(struct cosby_decoder *decoder) {
+  free_analyzer(&decoder->analyzer);
+  free_analyzer(&decoder->probe);
+  running_sum_free(&decoder->power_diffs);
+  fftw_free(decoder->window);
+  if (decoder->work_buffer != NULL && decoder->work_buffer != decoder->audio_buffer)
+    unmap_mirrored(decoder->work_buffer, decoder->audio_buffer_size, decoder->sample_size);
+  if (decoder->audio_buffer != NULL)
+    unmap_mirrored(decoder->audio_buffer, decoder->audio_buffer_size, sizeof(double));
+  if (decoder->resampler != NULL) {
+    free_resampler(decoder->resampler);
+    free(decoder->resampler);
+  }
+  free(decoder->staging);
+  free(decoder);
+}
+
+COSBY_API int cosby_decoder_framed(struct cosby_decoder *decoder) {
+  return decoder->framed;
+}
+
+COSBY_API double cosby_decoder_level(struct cosby_decoder *decoder) {
+  if (decoder->signal_power_count == 0)
+    return -INFINITY;
+  return 10.0*log10(decoder->signal_power_total/decoder->signal_power_count/
+		    decoder->full_scale_power_sq);
+}
+
+/* Symbol timing recovery.
+
+process_power() looks at every window, and works out where the
+symbols start from where the power difference changes sign. That's a
+window for every sample, when all we're after is one bit per symbol.
+
+This looks at one window per symbol instead, right where the middle
+of the symbol should be. When the bit changes, the power difference
+crossed zero somewhere between the last window and this one, and
+that's the edge between the two symbols. One more window halfway in
+between tells us which half it's in, and a straight line between the
+windows on either side of it says about where.
+
+The edge ought to be half a symbol before this window. If it isn't,
+we're looking a little early or late, and the next window moves over
+to make up part of the difference. If we keep on being early or late
+the same way, the tape's running fast or slow, so the time between
+windows changes a little, too. That's a phase locked loop, more or
+less. Until it finds the start of the data, it jumps right to where
+the edge says. After that, it only goes part of the way, so a bit of
+noise doesn't knock it around.
+
+At 44100, that's one window per symbol, plus one for every time the
+bit changes, instead of 16. */
+
+/* The power difference for the window starting at sample */
+double window_power(struct cosby_decoder *decoder, size_t sample, double *power_sq) {
+  double power_diff;
+  int stage = stats_enter(decoder->stats, STAGE_ANALYZE);
+  decoder->analyzer.analyze_block(&decoder->analyzer,
+				  (char *)decoder->work_buffer+
+				  sample%decoder->audio_buffer_size*decoder->sample_size,
+				  1, power_sq, &power_diff);
+  stats_enter(decoder->stats, stage);
+  if (decoder->stats != NULL)
+    decoder->stats->windows++;
+  return power_diff;
+}
+
+/* Where a straight line from (a, power_a) to (b, power_b) crosses
+   zero */
+double zero_crossing(double a, double power_a, double b, double power_b) {
+  if (power_a == power_b)
+    return (a+b)/2.0;
+  return a+(b-a)*power_a/(power_a-power_b);
+}
+
+int run_symbols(struct cosby_decoder *decoder, size_t end) {
+  size_t sample;
+  size_t middle;
+  double power_sq;
+  double power_diff;
+  double middle_diff;
+  double edge;
+  double error;
+  double drift = TIMING_MAX_DRIFT*decoder->symbol_time;
+  int bit;
+  int stage = stats_enter(decoder->stats, STAGE_SLICE);
+
+  while (!decoder->done) {
+    sample = (size_t)(decoder->next_sample+0.5);
+    if (sample+decoder->wavelength > end)
+      break;
+    power_diff = window_power(decoder, sample, &power_sq);
+    decoder->offset = sample;
+    if (signal_gone(decoder, power_sq))
+      break;
+
+    bit = decoder->current_symbol;
+    if (power_diff > decoder->threshold)
+      bit = 0;
+    else if (power_diff < decoder->threshold)
+      bit = 1;
+
+    if (bit != decoder->current_symbol && decoder->have_last) {
+      middle = (decoder->last_sample+sample)/2;
+      middle_diff = window_power(decoder, middle, &power_sq);
+      if ((middle_diff > 0.0) == (decoder->current_symbol == 0))
+	edge = zero_crossing(middle, middle_diff, sample, power_diff);
+      else
+	edge = zero_crossing(decoder->last_sample, decoder->last_diff, middle, middle_diff);
+
+      error = edge+decoder->symbol_period/2.0-decoder->next_sample;
+      if (error > decoder->symbol_period/2.0)
+	error = decoder->symbol_period/2.0;
+      if (error < -decoder->symbol_period/2.0)
+	error = -decoder->symbol_period/2.0;
+      if (decoder->framed) {
+	decoder->next_sample += TIMING_PHASE_GAIN*error;
+	decoder->symbol_period += TIMING_PERIOD_GAIN*error;
+	if (decoder->symbol_period > decoder->symbol_time+drift)
+	  decoder->symbol_period = decoder->symbol_time+drift;
+	if (decoder->symbol_period < decoder->symbol_time-drift)
+	  decoder->symbol_period = decoder->symbol_time-drift;
+      } else {
+	decoder->next_sample += error;
+      }
+    }
+    decoder->next_sample += decoder->symbol_period;
+    decoder->last_sample = sample;
+    decoder->last_diff = power_diff;
+    decoder->have_last = 1;
+    decoder->current_symbol = bit;
+    process_bit(decoder, bit);
+  }
+  flush_decoder_output(decoder);
+  stats_enter(decoder->stats, stage);
+  return decoder->done;
+}
+
+/* Looks at every window that fits before sample number end. A window
+   is one wavelength long, and there's one starting at every sample.
+   The analyzer does them a block at a time, and the back end takes
+   them one at a time, and stops as soon as the signal's gone. */
+int run_windows(struct cosby_decoder *decoder, size_t end) {
+  size_t count;
+  int stage = stats_enter(decoder->stats, STAGE_SLICE);
+  while (!decoder->done && decoder->offset+decoder->wavelength <= end) {
+    count = end-decoder->wavelength+1-decoder->offset;
+    if (count > FFT_BATCH_SIZE)
+      count = FFT_BATCH_SIZE;
+    stats_enter(decoder->stats, STAGE_ANALYZE);
+    decoder->analyzer.analyze_block(&decoder->analyzer,
+				    (char *)decoder->work_buffer+
+				    decoder->offset%decoder->audio_buffer_size*decoder->sample_size,
+				    count, decoder->power_sq, decoder->power_diff);
+    stats_enter(decoder->stats, STAGE_SLICE);
+    if (decoder->stats != NULL)
+      decoder->stats->windows += count;
+    if (decoder->on_power != NULL)
+      decoder->on_power(decoder->user, decoder->power_sq, decoder->power_diff, count);
+    for (size_t c=0;c<count && !decoder->done;c++) {
+      process_power(decoder, decoder->power_sq[c], decoder->power_diff[c]);
+      decoder->offset++;
+    }
+  }
+  flush_decoder_output(decoder);
+  stats_enter(decoder->stats, stage);
+  return decoder->done;
+}
+
+/* Skipping the quiet parts.
+
+A tape starts out with however much silence there is before somebody
+pressed play, and then five seconds or so of "0"s before the data.
+None of that is worth running the whole demodulator on. All it takes
+to find the data is a "1", and there are eight of those in a row
+right at the start of it.
+
+So, until it finds the data, the decoder looks at the audio a block
+at a time, with one window per symbol. Every window where the "1"
+frequency is the stronger one, and most of the window is those two
+frequencies instead of noise, counts as a "1". A block without a few
+of those doesn't have any data in it. If the next block doesn't
+either, we skip it. That way, there's always at least a block of the
+lead-in left to find the start of the data in, and anything
+interesting gets the whole demodulator.
+
+The blocks line up with SDFT_REFRESH, so the sliding DFT starts over
+from scratch right where we land, and gets exactly the same numbers
+as if we hadn't skipped anything. */
+
+/* The next window the decoder is going to look at */
+size_t next_window(struct cosby_decoder *decoder) {
+  if (decoder->settings.timing == TIMING_SYMBOL)
+    return (size_t)(decoder->next_sample+0.5);
+  return decoder->offset;
+}
+
+/* Whether most of the window starting at audio_samples is the two
+   frequencies we care about, and not noise. The analyzer has to be
+   doubles. Sets *power_sq and *power_diff like analyze_block(). */
+int is_tone(struct analyzer *analyzer, double *audio_samples,
+	    double *power_sq, double *power_diff) {
+  double energy = 0.0;
+  analyzer->analyze_block(analyzer, audio_samples, 1, power_sq, power_diff);
+
+  /* For a pure tone, the power is half a wavelength times the
+     energy of the windowed audio. For noise, it's a lot less. */
+  for (int c=0;c<analyzer->wavelength;c++) {
+    energy += (audio_samples[c]*analyzer->window[c])*(audio_samples[c]*analyzer->window[c]);
+  }
+  return (*power_sq) > QUIET_TONE*energy*analyzer->wavelength/2.0;
+}
+
+int block_is_quiet(struct cosby_decoder *decoder, size_t start) {
+  double power_sq;
+  double power_diff;
+  int ones = 0;
+  int stage = stats_enter(decoder->stats, STAGE_SKIP);
+
+  for (size_t sample=start;sample<start+QUIET_BLOCK_SIZE;sample+=decoder->symbol_length) {
+    if (is_tone(&decoder->probe, decoder->audio_buffer+sample%decoder->audio_buffer_size,
+		&power_sq, &power_diff) && power_diff < 0.0)
+      ones++;
+  }
+  stats_enter(decoder->stats, stage);
+  return ones < QUIET_MIN_ONES;
+}
+
+/* Skips quiet blocks, and returns how far the demodulator can go
+   before we need to check again */
+size_t skip_quiet(struct cosby_decoder *decoder, size_t end) {
+  size_t start;
+  int quiet;
+
+  while (!decoder->framed && next_window(decoder) >= decoder->quiet_until) {
+    start = next_window(decoder)/QUIET_BLOCK_SIZE*QUIET_BLOCK_SIZE;
+
+    /* After the end of the data, we could be partway into a block
+       we don't have all of anymore. Decode the rest of it, and start
+       checking again at the next one. */
+    if (start < decoder->offset) {
+      decoder->quiet_until = start+QUIET_BLOCK_SIZE;
+      break;
+    }
+    if (start+2*QUIET_BLOCK_SIZE+decoder->wavelength > end) {
+      /* Wait for more audio. If there isn't going to be any, just
+	 decode the rest. */
+      if (!decoder->finishing)
+	return next_window(decoder)+decoder->wavelength-1;
+      decoder->quiet_until = (size_t)-1;
+      break;
+    }
+    quiet = decoder->quiet_result;
+    if (decoder->quiet_block != start)
+      quiet = block_is_quiet(decoder, start);
+    decoder->quiet_block = start+QUIET_BLOCK_SIZE;
+    decoder->quiet_result = block_is_quiet(decoder, decoder->quiet_block);
+    if (quiet && decoder->quiet_result) {
+      decoder->offset = start+QUIET_BLOCK_SIZE;
+      decoder->next_sample = decoder->offset;
+      decoder->have_last = 0;
+      decoder->analyzer.sdft_count = decoder->offset;
+    } else {
+      decoder->quiet_until = start+QUIET_BLOCK_SIZE;
+    }
+  }
+  if (!decoder->framed && decoder->quiet_until < end-decoder->wavelength+1)
+    return decoder->quiet_until+decoder->wavelength-1;
+  return end;
+}
+
+/* Runs the demodulator over everything before sample number end,
+   except for whatever skip_quiet() skips */
+int run_decoder(struct cosby_decoder *decoder, size_t end) {
+  size_t until;
+  size_t before;
+  do {
+    before = next_window(decoder);
+    until = end;
+    if (decoder->settings.skip_quiet)
+      until = skip_quiet(decoder, end);
+    if (decoder->settings.timing == TIMING_SYMBOL)
+      run_symbols(decoder, until);
+    else
+      run_windows(decoder, until);
+  } while (!decoder->done && until != end && next_window(decoder) != before);
+  return decoder->done;
+}
+
+/* New audio goes right after what's already in the buffer. It's fine
+   if it wraps around the end, that's what the mirror is for. Anything
+   before the next window is history, and can be written over. */
+double *decoder_room(struct cosby_decoder *decoder, size_t *room) {
+  size_t end = decoder->audio_buffer_offset+decoder->audio_buffer_length;
+  (*room) = decoder->audio_buffer_size-(end-decoder->offset);
+  return decoder->audio_buffer+end%decoder->audio_buffer_size;
+}
+
+/* Copies count samples starting at sample number start over into the
+   work buffer */
+void decoder_convert(struct cosby_decoder *decoder, size_t start, size_t count) {
+  size_t pos = start%decoder->audio_buffer_size;
+  if (decoder->work_buffer != decoder->audio_buffer)
+    convert_samples(decoder->settings.precision, decoder->audio_buffer+pos,
+		    (char *)decoder->work_buffer+pos*decoder->sample_size, count);
+}
+
+int decoder_add(struct cosby_decoder *decoder, size_t count) {
+  int stage = stats_enter(decoder->stats, STAGE_COPY);
+  decoder_convert(decoder, decoder->audio_buffer_offset+decoder->audio_buffer_length, count);
+  stats_enter(decoder->stats, stage);
+  decoder->audio_buffer_length += count;
+  if (decoder->audio_buffer_length > decoder->audio_buffer_size) {
+    decoder->audio_buffer_offset += decoder->audio_buffer_length-decoder->audio_buffer_size;
+    decoder->audio_buffer_length = decoder->audio_buffer_size;
+  }
+  return run_decoder(decoder, decoder->audio_buffer_offset+decoder->audio_buffer_length);
+}
+
+/* Runs audio at the input rate through the resampler, right into the
+   buffer */
+int decoder_resample(struct cosby_decoder *decoder, const double *samples, size_t count) {
+  double *buffer;
+  size_t room;
+  size_t used;
+  size_t made;
+  int stage;
+  while (count > 0 && !decoder->done) {
+    buffer = decoder_room(decoder, &room);
+    stage = stats_enter(decoder->stats, STAGE_COPY);
+    made = resample(decoder->resampler, samples, count, buffer, room, &used);
+    stats_enter(decoder->stats, stage);
+    decoder_add(decoder, made);
+    samples += used;
+    count -= used;
+  }
+  return decoder->done;
+}
+
+/* If the audio needs resampling, it can't go right into the buffer,
+   so it waits in staging */
+COSBY_API double *cosby_decoder_buffer(struct cosby_decoder *decoder, size_t *room) {
+  if (decoder->resampler != NULL) {
+    (*room) = AUDIO_READ_SIZE;
+    return decoder->staging;
+  }
+  return decoder_room(decoder, room);
+}
+
+COSBY_API int cosby_decoder_commit(struct cosby_decoder *decoder, size_t count) {
+  if (decoder->resampler != NULL)
+    return decoder_resample(decoder, decoder->staging, count);
+  return decoder_add(decoder, count);
+}
+
+COSBY_API int cosby_decoder_push(struct cosby_decoder *decoder,
+				 const double *samples, size_t count) {
+  double *buffer;
+  size_t room;
+  int stage;
+  if (decoder->resampler != NULL)
+    return decoder_resample(decoder, samples, count);
+  while (count > 0 && !decoder->done) {
+    buffer = decoder_room(decoder, &room);
+    if (room > count)
+      room = count;
+    stage = stats_enter(decoder->stats, STAGE_COPY);
+    memcpy(buffer, samples, room*sizeof(double));
+    stats_enter(decoder->stats, stage);
+    decoder_add(decoder, room);
+    samples += room;
+    count -= room;
+  }
+  return decoder->done;
+}
+
+/* There's a window starting at every sample, even the last one. The
+   windows that run off the end get zeros.
+
+   The resampler's filter is running half its taps behind, so it gets
+   that many zeros first to push out the end of the audio. Any more
+   than that would be more silence than the recording had, and the
+   decoder could make a byte out of it. */
+COSBY_API int cosby_decoder_finish(struct cosby_decoder *decoder) {
+  size_t end;
+  size_t zeros;
+  if (decoder->resampler != NULL) {
+    memset(decoder->staging, 0, AUDIO_READ_SIZE*sizeof(double));
+    for (size_t left=decoder->resampler->taps/2;left>0;left-=zeros) {
+      zeros = (left < AUDIO_READ_SIZE) ? left : AUDIO_READ_SIZE;
+      decoder_resample(decoder, decoder->staging, zeros);
+    }
+  }
+  end = decoder->audio_buffer_offset+decoder->audio_buffer_length;
+  decoder->finishing = 1;
+  if (end > decoder->offset && !decoder->done) {
+    memset(decoder->audio_buffer+end%decoder->audio_buffer_size, 0,
+	   (decoder->wavelength-1)*sizeof(double));
+    decoder_convert(decoder, end, decoder->wavelength-1);
+    run_decoder(decoder, end+decoder->wavelength-1);
+  }
+  return decoder->done;
+}
+
+#ifndef COSBY_LIBRARY
+
+int read_from_file(void *in_file, double *buffer, size_t count) {
+  return sf_read_double((SNDFILE *)in_file, buffer, count);
+}
+
+/* Plain old 16 bit mono audio doesn't need libsndfile. It's
+   just a bunch of numbers in a row, so we map the whole file into
+   memory and read the numbers right out of it. The kernel pages it in
+   as we go, and there are no read() calls at all. */
+struct mapped_input {
+  unsigned char *map;
+  size_t map_length;
+  unsigned char *samples;
+  size_t frames;
+  int rate;
+  size_t pos;
+  size_t released;
+};
+
+/* Stop holding on to audio we've already read once this much piles up */
+#define MAPPED_RELEASE_SIZE (16*1024*1024)
+
+int read_from_mapped(void *in_file, double *buffer, size_t count) {
+  struct mapped_input *input = (struct mapped_input *)in_file;
+  unsigned char *sample;
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t done;
+
+  if (count > input->frames-input->pos)
+    count = input->frames-input->pos;
+
+  /* The samples are little endian no matter what we're running on.
+     This divides the same way libsndfile does, so the results
+     are exactly the same either way. */
+  sample = input->samples+input->pos*2;
+  for (int c=0;c<count;c++) {
+    buffer[c] = (short)(sample[0] | (sample[1] << 8))/32768.0;
+    sample += 2;
+  }
+  input->pos += count;
+
+  /* Tell the kernel it can have back the pages we're done with. On a
+     file bigger than memory, this keeps us from pushing everything
+     else out of memory. */
+  done = (sample-input->map)/page*page;
+  if (done-input->released >= MAPPED_RELEASE_SIZE) {
+    madvise(input->map+input->released, done-input->released, MADV_DONTNEED);
+    input->released = done;
+  }
+  return count;
+}
+
+/* Numbers in .WAV files are little endian */
+unsigned int little_endian_at(unsigned char *bytes, int size) {
+  unsigned int result = 0;
+  for (int c=size-1;c>=0;c--) {
+    result = (result << 8) | bytes[c];
+  }
+  return result;
+}
+
+/* Finds the audio in a .WAV file. Returns 0 if it's 16 bit mono and
+   everything makes sense, or -1 if libsndfile ought to deal with it.
+
+   A .WAV file is a bunch of "chunks." Each starts with a four letter
+   name and a length. The "fmt " chunk says what kind of audio it is,
+   and the "data" chunk has the audio itself. */
+int find_wave_data(struct mapped_input *input) {
+  unsigned char *chunk = input->map+12;
+  unsigned char *end = input->map+input->map_length;
+  unsigned int chunk_length;
+  int format_ok = 0;
+
+  if (input->map_length < 12 ||
+      0!=memcmp(input->map,"RIFF",4) || 0!=memcmp(input->map+8,"WAVE",4))
+    return -1;
+
+  while (end-chunk >= 8) {
+    chunk_length = little_endian_at(chunk+4,4);
+    if (0==memcmp(chunk,"fmt ",4)) {
+      if (chunk_length < 16 || end-chunk-8 < 16)
+	return -1;
+      /* PCM, one channel, 16 bits */
+      format_ok = (little_endian_at(chunk+8,2) == 1 &&
+		   little_endian_at(chunk+10,2) == 1 &&
+		   little_endian_at(chunk+22,2) == 16);
+      input->rate = little_endian_at(chunk+12,4);
+    } else if (0==memcmp(chunk,"data",4)) {
+      if (!format_ok)
+	return -1;
+      input->samples = chunk+8;
+      /* Programs that write .WAV files as they go sometimes never
+	 fill in the length. Just use whatever's there. */
+      if (chunk_length > end-input->samples)
+	chunk_length = end-input->samples;
+      input->frames = chunk_length/2;
+      return 0;
+    }
+    /* Chunks are padded out to an even length */
+    if (chunk_length > end-chunk-8)
+      return -1;
+    chunk += 8+chunk_length+(chunk_length&1);
+  }
+  return -1;
+}
+
+/* Raw audio has no header at all, so there's no way to tell what it
+   is. If it's named .raw or .pcm, we assume it's exactly what cosby
+   would write: 16 bit little endian mono at our sample rate. */
+int is_raw_filename(char *wave_filename) {
+  size_t length = strlen(wave_filename);
+  return (length > 4 &&
+	  (0==strcasecmp(wave_filename+length-4,".raw") ||
+	   0==strcasecmp(wave_filename+length-4,".pcm")));
+}
+
+/* Returns 0 if the file got mapped, or -1 if it's something that needs
+   libsndfile */
+int init_mapped_input(void **in_file, char *wave_filename) {
+  struct mapped_input *input;
+  struct stat file_stat;
+  int fd;
+
+  if ((fd = open(wave_filename, O_RDONLY)) < 0)
+    return -1;
+  if (fstat(fd, &file_stat) < 0 || file_stat.st_size == 0 ||
+      (input = malloc(sizeof(struct mapped_input))) == NULL) {
+    close(fd);
+    return -1;
+  }
+  input->map_length = file_stat.st_size;
+  input->map = mmap(NULL, input->map_length, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (input->map == MAP_FAILED) {
+    free(input);
+    return -1;
+  }
+  input->pos = 0;
+  input->released = 0;
+
+  if (is_raw_filename(wave_filename)) {
+    input->samples = input->map;
+    input->frames = input->map_length/2;
+    input->rate = DEFAULT_SAMPLE_RATE;
+  } else if (find_wave_data(input) < 0) {
+    munmap(input->map, input->map_length);
+    free(input);
+    return -1;
+  }
+
+  /* We read straight through from beginning to end, so the kernel can
+     read ahead as far as it likes */
+  madvise(input->map, input->map_length, MADV_SEQUENTIAL);
+  (*in_file) = (void *)input;
+  return 0;
+}
+
+void close_mapped_input(void *in_file) {
+  struct mapped_input *input = (struct mapped_input *)in_file;
+  munmap(input->map, input->map_length);
+  free(input);
+}
+
+void close_file_input(void *in_file) {
+  sf_close((SNDFILE *)in_file);
+}
+
+void close_mic_input(void *device) {
+  snd_pcm_close((snd_pcm_t *)device);
+}
+
+/* Opens a .WAV file, and sets up read_samples and close_input for it.
+   We read it ourselves if we can, otherwise libsndfile does it. Sets
+   *rate to its sample rate. */
+int init_file_input(void **in_file,
+		    int (**read_samples)(void *device, double *buffer, size_t count),
+		    void (**close_input)(void *device), int *rate, char *wave_filename) {
+  SF_INFO file_info;
+  if (init_mapped_input(in_file, wave_filename) == 0) {
+    (*read_samples) = &read_from_mapped;
+    (*close_input) = &close_mapped_input;
+    (*rate) = ((struct mapped_input *)(*in_file))->rate;
+    return 0;
+  } else if (is_raw_filename(wave_filename)) {
+    cosby_print_err("Couldn't open %s\n",wave_filename);
+    return -1;
+  }
+
+  memset((void *)&file_info,0,sizeof(SF_INFO));
+  (*in_file) = sf_open(wave_filename, SFM_READ, &file_info);
+  (*read_samples) = &read_from_file;
+  (*close_input) = &close_file_input;
+  if ((*in_file) == NULL) {
+    cosby_print_err("Couldn't open %s\n",wave_filename);
+    return -1;
+  } else if (file_info.channels != 1) {
+    cosby_print_err("Sorry, this program is lame and only supports mono .WAV files\n");
+    sf_close((SNDFILE *)(*in_file));
+    return -1;
+  }
+  (*rate) = file_info.samplerate;
+
+  return 0;
+}
+int init_mic_input(void **device) {
+  snd_pcm_hw_params_t *hwparams;
+  snd_pcm_format_t format;
+  unsigned int rate = DEFAULT_SAMPLE_RATE;
+  int err;
+  
+  snd_pcm_hw_params_alloca(&hwparams);
+  if (is_bigendian())
+    format = SND_PCM_FORMAT_S16_BE;
+  else
+    format = SND_PCM_FORMAT_S16_LE;
+  if ((err = snd_pcm_open((snd_pcm_t **)device, ALSA_AUDIO_DEVICE, SND_PCM_STREAM_CAPTURE, 0)) < 0) {
+    cosby_print_err("Uhhh... I don't think this computer has speakers (%d)\n",err);
+    return -1;
+  }
+
+  if ((err = snd_pcm_hw_params_any((snd_pcm_t *)(*device), hwparams)) < 0) {
+    cosby_print_err("Your sounds is really fd up dude. (%d)\n",err);
+    return -1;
+  }
+  if ((err = snd_pcm_hw_params_set_rate_resample((snd_pcm_t *)(*device), hwparams, 0)) < 0) {
+    cosby_print_err("Dude! I just said it's fine to resample and your soundscared freaked out on me (%d)\n",err);
+    return -1;
+  }
+  if ((err = snd_pcm_hw_params_set_format((snd_pcm_t *)(*device), hwparams, format)) < 0) {
+    cosby_print_err("Hey there. You don't support 16bit sound? Is this 1991? (%d)\n",err);
+    return -1;
+  }
+  if ((err = snd_pcm_hw_params_set_channels((snd_pcm_t *)(*device), hwparams, 2)) < 0) {
+    cosby_print_err("Dude! WTF! No stereo sound! (%d)\n",err);
+    return -1;
+  }
+  if ((err = snd_pcm_hw_params_set_access((snd_pcm_t *)(*device), hwparams, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
+    cosby_print_err("ALSA is seriously braindead. Consider writing a letter to the mailing list complaining. (%d)\n",err);
+    return -1;
+  }
+  if ((err = snd_pcm_hw_params_set_rate_near((snd_pcm_t *)(*device), hwparams, &rate, 0)) < 0) {
+    cosby_print_err("I think you have a sound card from 1990 (%d)\n",err);
+    return -1;
+  }
+  if ((err = snd_pcm_hw_params((snd_pcm_t *)(*device), hwparams) < 0)) {
+    cosby_print_err("Yur soundscard is br0kn!! (%d)\n",err);
+    return -1;
+  }
+  return 0;
+}
+
+/* Recording live is a race. The sound card only holds on to a
+   fraction of a second of audio. If we're busy decoding when it fills
+   up, ALSA throws away audio (an "overrun"), and the bits in it are
+   gone for good.
+
+   So, a thread does nothing but pull audio off the sound card as fast
+   as it comes in, and drop it into a big queue. The main thread
+   decodes from the other end of the queue whenever it gets
+   around to it. If decoding falls behind for a bit, the queue soaks
+   it up.
+
+   Only one thread ever writes to the queue and only one reads
+   from it, so there's no need for locks. The capture thread only
+   moves head, and the main thread only moves tail. Each one reads the
+   other's counter with acquire and writes its own with release, so
+   the samples are always there before the counter says they are. */
+struct capture_queue {
+  snd_pcm_t *device;
+  pthread_t thread;
+  short *samples;
+  size_t head;
+  size_t tail;
+  int running;
+
+  /* Samples that didn't fit in the queue, and the times ALSA ran out
+     of room */
+  unsigned long dropped;
+  unsigned long overruns;
+};
+
+void *run_capture(void *arg) {
+  struct capture_queue *queue = (struct capture_queue *)arg;
+  short short_samples[AUDIO_READ_SIZE*2];
+  size_t head;
+  size_t room;
+  int count;
+
+  while (__atomic_load_n(&queue->running, __ATOMIC_ACQUIRE)) {
+    if ((count = snd_pcm_readi(queue->device,(void *)short_samples, AUDIO_READ_SIZE)) < 0) {
+      /* Keep going. Losing a little audio beats losing all of it. */
+      if (count == -EPIPE)
+	queue->overruns++;
+      else
+	cosby_debug("Input troubles... %d\n",count);
+      if (snd_pcm_recover(queue->device, count, 1) < 0) {
+	cosby_print_err("Input troubles... %d\n",count);
+	break;
+      }
+      continue;
+    }
+
+    head = queue->head;
+    room = CAPTURE_QUEUE_SIZE-(head-__atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE));
+    if (count > room) {
+      queue->dropped += count-room;
+      count = room;
+    }
+    for (int c=0;c<count;c++) {
+      /* Only look at the left channel, even though we get both as input */
+      queue->samples[(head+c)%CAPTURE_QUEUE_SIZE] = short_samples[c*2];
+    }
+    __atomic_store_n(&queue->head, head+count, __ATOMIC_RELEASE);
+  }
+
+  /* Let the reader know there's nothing more coming */
+  __atomic_store_n(&queue->running, 0, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+/* Waits until there are count samples in the queue, unless the
+   capture thread stopped */
+int read_from_capture(void *in_file, double *samples, size_t count) {
+  struct capture_queue *queue = (struct capture_queue *)in_file;
+  struct timespec nap = { 0, 2000000 };
+  size_t tail = queue->tail;
+  size_t available;
+
+  while ((available = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE)-tail) < count &&
+	 __atomic_load_n(&queue->running, __ATOMIC_ACQUIRE) && !interrupted) {
+    nanosleep(&nap, NULL);
+  }
+  /* Check again, in case it put in a few more before stopping */
+  available = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE)-tail;
+  if (available < count)
+    count = available;
+  for (int c=0;c<count;c++) {
+    samples[c] = queue->samples[(tail+c)%CAPTURE_QUEUE_SIZE]/32768.0;
+  }
+  __atomic_store_n(&queue->tail, tail+count, __ATOMIC_RELEASE);
+  return count;
+}
+
+/* Opens the sound card and starts the capture thread.
+
+   With --realtime, the capture thread asks for real-time priority, so
+   it gets the CPU before anything else on the machine. That usually
+   takes root or an entry in /etc/security/limits.conf. If we can't get
+   it, we carry on without it. */
+int init_capture_input(void **in_file) {
+  struct capture_queue *queue;
+  pthread_attr_t attr;
+  struct sched_param param;
+  int started = 0;
+
+  queue = calloc(1, sizeof(struct capture_queue));
+  if (queue == NULL)
+    return -1;
+  queue->samples = malloc(sizeof(short)*CAPTURE_QUEUE_SIZE);
+  if (queue->samples == NULL ||
+      init_mic_input((void **)&queue->device) < 0)
+    return -1;
+  queue->running = 1;
+
+  if (capture_realtime) {
+    pthread_attr_init(&attr);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+    param.sched_priority = sched_get_priority_min(SCHED_FIFO)+10;
+    pthread_attr_setschedparam(&attr, &param);
+    started = (pthread_create(&queue->thread, &attr, &run_capture, queue) == 0);
+    pthread_attr_destroy(&attr);
+    if (!started)
+      cosby_print_err("Couldn't get real-time priority. Recording without it.\n");
+  }
+  if (!started && pthread_create(&queue->thread, NULL, &run_capture, queue) != 0) {
+    cosby_print_err("Couldn't start the capture thread\n");
+    return -1;
+  }
+  (*in_file) = (void *)queue;
+  return 0;
+}
+
+void close_capture_input(void *in_file) {
+  struct capture_queue *queue = (struct capture_queue *)in_file;
+  __atomic_store_n(&queue->running, 0, __ATOMIC_RELEASE);
+  pthread_join(queue->thread, NULL);
+  if (queue->dropped > 0 || queue->overruns > 0)
+    cosby_print("Lost audio: %lu samples didn't fit in the queue, the sound card overran %lu times\n",
+		queue->dropped, queue->overruns);
+  close_mic_input(queue->device);
+  free(queue->samples);
+  free(queue);
+}
+
+/* Where the decoded bytes go.
+
+The decoder hands them over a couple hundred at a time. Instead of
+going through stdio with each lot, they pile up in a sink, and get
+written straight to the file in big blocks. A sink can also keep
+everything in memory, for when we want to look at the bytes instead of
+saving them.
+
+When they get written out depends on --flush. By default, it's at the
+end of each record, and whenever the buffer fills up. With a number,
+it's every that many bytes, for keeping an eye on a long capture as
+it comes in. With "signal", it's only when the buffer fills up, when
+we stop, and when somebody sends us SIGUSR1, which works with the
+others, too.
+
+Whichever it is, Ctrl-C doesn't lose anything anymore. It stops the
+recording like the audio ran out, and everything decoded up to there
+gets written. Hit it again if that's not fast enough. */
+struct output_sink {
+  int fd;         /* -1 for memory */
+  int owned;      /* Whether we close fd when we're done */
+  unsigned char *buffer;
+  size_t length;
+  size_t size;
+  int failed;
+  struct output_sink *tee; /* Another sink that gets a copy of everything */
+};
+
+/* Opens filename for writing into, or stdout if it's NULL. Returns
+   -1 if it can't. */
+int sink_open(struct output_sink *sink, char *filename) {
+  sink->fd = 1;
+  sink->owned = 0;
+  if (filename != NULL) {
+    sink->fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    sink->owned = 1;
+  }
+  sink->size = SINK_BUFFER_SIZE;
+  sink->buffer = malloc(sink->size);
+  sink->length = 0;
+  sink->failed = 0;
+  sink->tee = NULL;
+  if (sink->fd < 0 || sink->buffer == NULL) {
+    cosby_print_err("Couldn't open %s\n",filename);
+    if (sink->fd >= 0 && sink->owned)
+      close(sink->fd);
+    free(sink->buffer);
+    return -1;
+  }
+  return 0;
+}
+
+/* A sink that keeps everything in sink->buffer */
+int sink_open_memory(struct output_sink *sink) {
+  sink->fd = -1;
+  sink->owned = 0;
+  sink->size = SINK_BUFFER_SIZE;
+  sink->buffer = malloc(sink->size);
+  sink->length = 0;
+  sink->failed = 0;
+  sink->tee = NULL;
+  return (sink->buffer == NULL) ? -1 : 0;
+}
+
+/* Writes out everything that's piled up. Memory sinks just keep
+   it. */
+void sink_flush(struct output_sink *sink) {
+  size_t done = 0;
+  ssize_t written;
+  int stage;
+  if (sink->fd < 0)
+    return;
+  stage = stats_enter(recording_stats, STAGE_WRITE);
+  while (done < sink->length && !sink->failed) {
+    written = write(sink->fd, sink->buffer+done, sink->length-done);
+    if (written < 0 && errno != EINTR) {
+      cosby_print_err("Couldn't write the output: %s\n",strerror(errno));
+      sink->failed = 1;
+    } else if (written > 0) {
+      done += written;
+    }
+  }
+  stats_enter(recording_stats, stage);
+  sink->length = 0;
+}
+
+void sink_write(struct output_sink *sink, const unsigned char *bytes, size_t count) {
+  if (sink->tee != NULL)
+    sink_write(sink->tee, bytes, count);
+  if (sink->length+count > sink->size && sink->fd >= 0)
+    sink_flush(sink);
+  while (sink->length+count > sink->size) {
+    sink->size *= 2;
+    sink->buffer = realloc(sink->buffer, sink->size);
+    if (sink->buffer == NULL) {
+      cosby_print_err("Out of memory for the output\n");
+      exit(1);
+    }
+  }
+  memcpy(sink->buffer+sink->length, bytes, count);
+  sink->length += count;
+  if (sink->fd >= 0 &&
+      (flush_requested || (flush_policy == FLUSH_BYTES && sink->length >= flush_bytes))) {
+    flush_requested = 0;
+    sink_flush(sink);
+  }
+}
+
+/* The end of a record is a good time to write it out */
+void sink_end_record(struct output_sink *sink) {
+  if (flush_policy == FLUSH_RECORD)
+    sink_flush(sink);
+}
+
+void sink_close(struct output_sink *sink) {
+  sink_flush(sink);
+  if (sink->owned)
+    close(sink->fd);
+  free(sink->buffer);
+}
+
+/* SIGUSR1 can come in the middle of a long quiet stretch with no
+   bytes coming out, so the decode loops check for it between blocks,
+   too */
+void flush_if_requested(struct output_sink *sink) {
+  if (flush_requested && sink != NULL && sink->fd >= 0) {
+    flush_requested = 0;
+    sink_flush(sink);
+  }
+}
+
+/* A long recording takes a long time to decode one sample after
+   another. Most of that time goes to the front end, working out the
+   power at each offset. That part doesn't remember anything from one
+   offset to the next (well, the sliding DFT does, but it starts over
+   every SDFT_REFRESH samples). So, the recording can be chopped up into
+   segments, and each thread can work out the power for a segment on
+   its own.
+
+   The back end, process_power(), remembers everything, so it gets fed
+   the results one thread after another, in order, by the main
+   thread. The seams between segments are invisible to it. It sees
+   exactly the same numbers as it would have going straight through,
+   so the output is exactly the same, byte for byte.
+
+   This needs to see the whole recording at once, so it only works on
+   mapped input that doesn't need resampling. */
+struct front_end_job {
+  pthread_t thread;
+  struct analyzer analyzer;
+  struct mapped_input *input;
+  size_t start;
+  size_t count;
+  double *audio;
+  void *work;
+  double *power_sq;
+  double *power_diff;
+};
+
+void *run_front_end_job(void *arg) {
+  struct front_end_job *job = (struct front_end_job *)arg;
+  size_t sample;
+  unsigned char *bytes;
+
+  /* Get the audio for every window in the segment, with zeros past
+     the end of the recording, just like cosby_decoder_finish() */
+  for (int c=0;c<job->count+job->analyzer.wavelength-1;c++) {
+    sample = job->start+c;
+    if (sample < job->input->frames) {
+      bytes = job->input->samples+sample*2;
+      job->audio[c] = (short)(bytes[0] | (bytes[1] << 8))/32768.0;
+    } else {
+      job->audio[c] = 0.0;
+    }
+  }
+  convert_samples(job->analyzer.precision, job->audio, job->work,
+		  job->count+job->analyzer.wavelength-1);
+  job->analyzer.analyze_block(&job->analyzer, job->work, job->count,
+			      job->power_sq, job->power_diff);
+  return NULL;
+}
+
+/* The segment size has to be a multiple of SDFT_REFRESH */
+#define PARALLEL_SEGMENT_SIZE (16*SDFT_REFRESH)
+
+/* The jobs come from calloc, so this works on ones that only got
+   halfway set up, too */
+void free_front_end_jobs(struct front_end_job *jobs) {
+  for (int c=0;c<decode_threads;c++) {
+    free_analyzer(&jobs[c].analyzer);
+    if (jobs[c].work != jobs[c].audio)
+      free(jobs[c].work);
+    free(jobs[c].audio);
+    free(jobs[c].power_sq);
+    free(jobs[c].power_diff);
+  }
+  free(jobs);
+}
+
+/* Returns -1 before it's looked at any audio if it can't set up the
+   threads, so the caller can do it all in one instead */
+int decode_in_parallel(struct cosby_decoder *decoder, struct mapped_input *input) {
+  struct front_end_job *jobs;
+  size_t offset = 0;
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t done;
+  int finished = 0;
+  int started;
+  int stage;
+
+  jobs = calloc(decode_threads, sizeof(struct front_end_job));
+  if (jobs == NULL)
+    return -1;
+  for (int c=0;c<decode_threads;c++) {
+    jobs[c].input = input;
+    jobs[c].audio = malloc(sizeof(double)*(PARALLEL_SEGMENT_SIZE+decoder->wavelength));
+    jobs[c].work = jobs[c].audio;
+    if (decoder->work_buffer != decoder->audio_buffer)
+      jobs[c].work = malloc(decoder->sample_size*(PARALLEL_SEGMENT_SIZE+decoder->wavelength));
+    jobs[c].power_sq = malloc(sizeof(double)*PARALLEL_SEGMENT_SIZE);
+    jobs[c].power_diff = malloc(sizeof(double)*PARALLEL_SEGMENT_SIZE);
+    if (jobs[c].audio == NULL || jobs[c].work == NULL || jobs[c].power_sq == NULL ||
+	jobs[c].power_diff == NULL ||
+	init_analyzer(&jobs[c].analyzer, decoder->window, decoder->wavelength,
+		      decoder->settings.engine, decoder->settings.precision,
+		      decoder->simd, decoder->settings.plan, 0)) {
+      cosby_print_err("Not enough memory for %d threads. Using one.\n",decode_threads);
+      free_front_end_jobs(jobs);
+      return -1;
+    }
+  }
+
+  /* Every window starting inside the recording gets looked at, just
+     like when it's pushed through the decoder. With --stats, the
+     threads reading and analyzing the audio all count as analyzing,
+     for as long as we're waiting for them. */
+  stage = stats_enter(decoder->stats, STAGE_ANALYZE);
+  while (!finished && offset < input->frames && !interrupted) {
+    started = 0;
+    for (int c=0;c<decode_threads && offset < input->frames;c++) {
+      jobs[c].start = offset;
+      jobs[c].count = input->frames-offset;
+      if (jobs[c].count > PARALLEL_SEGMENT_SIZE)
+	jobs[c].count = PARALLEL_SEGMENT_SIZE;
+      jobs[c].analyzer.sdft_count = offset;
+      offset += jobs[c].count;
+      if (pthread_create(&jobs[c].thread, NULL, &run_front_end_job, &jobs[c]) != 0) {
+	/* Do it ourselves */
+	run_front_end_job(&jobs[c]);
+	jobs[c].thread = pthread_self();
+      }
+      started++;
+    }
+    for (int c=0;c<started;c++) {
+      if (!pthread_equal(jobs[c].thread, pthread_self()))
+	pthread_join(jobs[c].thread, NULL);
+      stats_enter(decoder->stats, STAGE_SLICE);
+      if (decoder->stats != NULL) {
+	decoder->stats->samples += jobs[c].count;
+	decoder->stats->windows += jobs[c].count;
+      }
+      if (decoder->on_power != NULL)
+	decoder->on_power(decoder->user, jobs[c].power_sq, jobs[c].power_diff, jobs[c].count);
+      for (int n=0;n<jobs[c].count && !finished;n++) {
+	finished = process_power(decoder, jobs[c].power_sq[n], jobs[c].power_diff[n]);
+	decoder->offset++;
+      }
+      stats_enter(decoder->stats, STAGE_ANALYZE);
+    }
+    stats_enter(decoder->stats, STAGE_SLICE);
+    flush_decoder_output(decoder);
+    flush_if_requested(recording_sink);
+    stats_enter(decoder->stats, STAGE_ANALYZE);
+
+    /* We're done with this part of the file */
+    done = (input->samples-input->map+offset*2)/page*page;
+    if (done > input->released) {
+      madvise(input->map+input->released, done-input->released, MADV_DONTNEED);
+      input->released = done;
+    }
+  }
+
+  free_front_end_jobs(jobs);
+  stats_enter(decoder->stats, stage);
+  return 0;
+}
+
+void stop_recording(int number) {
+  interrupted = 1;
+}
+
+void request_flush(int number) {
+  flush_requested = 1;
+}
+
+/* Ctrl-C stops the recording instead of the program. It only works
+   once, so if we're stuck, the next one stops the program after all. */
+void catch_interrupts(struct sigaction *old_action) {
+  struct sigaction action;
+  memset(&action, 0, sizeof(struct sigaction));
+  action.sa_handler = &stop_recording;
+  action.sa_flags = SA_RESETHAND;
+  sigemptyset(&action.sa_mask);
+  interrupted = 0;
+  sigaction(SIGINT, &action, old_action);
+  action.sa_handler = &request_flush;
+  action.sa_flags = SA_RESTART;
+  sigaction(SIGUSR1, &action, NULL);
+}
+
+/* The decoder calls these with what it found */
+void record_bytes(void *sink, const unsigned char *bytes, size_t count) {
+  sink_write((struct output_sink *)sink, bytes, count);
+}
+
+void record_event(void *sink, int event, size_t offset) {
+  if (event == COSBY_EVENT_FRAMED) {
+    got_signal = 1;
+    cosby_print("Got a signal!\n");
+  } else if (event == COSBY_EVENT_DONE) {
+    sink_end_record((struct output_sink *)sink);
+  }
+}
+
+/* A tape side with a bunch of programs saved on it, one after the
+other, gets decoded in one go. Every time the signal ends, the decoder
+starts looking for the next one, and each record goes in its own
+file. tape.dat turns into tape-01.dat, tape-02.dat and so on, with an
+index in tape.idx that says where each one was on the tape:
+
+# record  start  end  start seconds  seconds  bytes  level dB  file
+1         ...
+
+start and end are in samples of the recording, at its own rate, so
+you can find them in an audio editor. The level is how loud the data
+was, compared to the loudest a "0" can be. */
+struct record_split {
+  struct cosby_decoder *decoder;
+  char *base;
+  char *extension;
+  char *name;
+  struct output_sink out;
+  int in_record;
+  FILE *index;
+  int number;
+  size_t start;
+  long long bytes;
+  int rate;
+  int input_rate;
+};
+
+/* Returns a copy of filename without its extension, and points
+   *extension at the extension */
+char *name_base(char *filename, char **extension) {
+  char *dot = strrchr(filename, '.');
+
+  /* An extension is a dot after the last slash, not at the start */
+  if (dot != NULL && (strchr(dot, '/') != NULL || dot == filename || dot[-1] == '/'))
+    dot = NULL;
+  if (dot == NULL)
+    dot = filename+strlen(filename);
+  (*extension) = dot;
+  return strndup(filename, dot-filename);
+}
+
+/* tape.wav's index is tape.idx */
+char *index_name_for(char *filename) {
+  char *extension;
+  char *base = name_base(filename, &extension);
+  char *index_name = malloc(strlen(filename)+8);
+  if (base == NULL || index_name == NULL)
+    return NULL;
+  sprintf(index_name, "%s.idx", base);
+  free(base);
+  return index_name;
+}
+
+int start_splitting(struct record_split *split, char *data_filename, int rate, int input_rate) {
+  char *index_name;
+
+  split->base = name_base(data_filename, &split->extension);
+  split->name = malloc(strlen(data_filename)+16);
+  index_name = index_name_for(data_filename);
+  if (split->base == NULL || split->name == NULL || index_name == NULL)
+    return -1;
+  split->index = fopen(index_name, "w");
+  if (split->index == NULL) {
+    cosby_print_err("Couldn't open %s\n",index_name);
+    free(index_name);
+    return -1;
+  }
+  free(index_name);
+  fprintf(split->index, "# record\tstart\tend\tstart seconds\tseconds\tbytes\tlevel dB\tfile\n");
+  split->decoder = NULL;
+  split->in_record = 0;
+  split->number = 0;
+  split->rate = rate;
+  split->input_rate = input_rate;
+  return 0;
+}
+
+/* Decoder offsets are at the rate it works at, and the index is at
+   the recording's rate */
+size_t split_offset(struct record_split *split, size_t offset) {
+  return (size_t)((double)offset*split->input_rate/split->rate+0.5);
+}
+
+void end_record(struct record_split *split, size_t offset) {
+  size_t start = split_offset(split, split->start);
+  size_t end = split_offset(split, offset);
+  double level = cosby_decoder_level(split->decoder);
+
+  sink_close(&split->out);
+  split->in_record = 0;
+  recording_sink = NULL;
+  fprintf(split->index, "%d\t%zu\t%zu\t%.3f\t%.3f\t%lld\t%.1f\t%s\n",
+	  split->number, start, end, (double)start/split->input_rate,
+	  (double)(end-start)/split->input_rate, split->bytes, level, split->name);
+  fflush(split->index);
+  cosby_print("Record %d: %lld bytes, %.1fs long, %.1fdB -> %s\n",
+	      split->number, split->bytes, (double)(end-start)/split->input_rate,
+	      level, split->name);
+}
+
+void split_bytes(void *user, const unsigned char *bytes, size_t count) {
+  struct record_split *split = (struct record_split *)user;
+  if (split->in_record)
+    sink_write(&split->out, bytes, count);
+  split->bytes += count;
+}
+
+void split_event(void *user, int event, size_t offset) {
+  struct record_split *split = (struct record_split *)user;
+  if (event == COSBY_EVENT_FRAMED) {
+    got_signal = 1;
+    split->number++;
+    sprintf(split->name, "%s-%02d%s", split->base, split->number, split->extension);
+    split->in_record = (sink_open(&split->out, split->name) == 0);
+    if (split->in_record)
+      recording_sink = &split->out;
+    split->start = offset;
+    split->bytes = 0;
+    cosby_print("Got record %d at %.1fs\n",split->number,
+		(double)split_offset(split, offset)/split->input_rate);
+  } else if (event == COSBY_EVENT_DONE && split->in_record) {
+    end_record(split, offset);
+  }
+}
+
+/* If the recording stops in the middle of a record, that's where it
+   ends */
+void finish_splitting(struct record_split *split) {
+  if (split->in_record)
+    end_record(split, split->decoder->offset);
+  cosby_print("Found %d records\n",split->number);
+  fclose(split->index);
+  free(split->base);
+  free(split->name);
+}
+
+/* Finding the records without decoding them.
+
+A long recording of a whole tape can take a while to decode, and it's
+a shame to decode all of it to get the one program you're after. But
+you don't need the whole demodulator to find out where the records
+are. A record is a bunch of tone with some "1"s in it, and between
+records there's no tone at all.
+
+So the scan looks at one window per wave, a tenth of a second at a
+time. A block where at least half the windows are tone is part of a
+record. Half a second without any of those, and the record's over.
+That's a few percent of the work of decoding it. The index it writes
+is just like the one from --records, with - for the bytes and file,
+since it doesn't know them. */
+struct scan {
+  FILE *index;
+  int rate;
+  int number;
+  int in_record;
+  int has_ones;
+  size_t start;
+  size_t end;
+  double power_total;
+  size_t power_count;
+  double full_scale_power_sq;
+};
+
+void end_scanned_record(struct scan *scan) {
+  double level = -INFINITY;
+  scan->in_record = 0;
+  if (!scan->has_ones)
+    return;
+  if (scan->power_count > 0)
+    level = 10.0*log10(scan->power_total/scan->power_count/scan->full_scale_power_sq);
+  scan->number++;
+  fprintf(scan->index, "%d\t%zu\t%zu\t%.3f\t%.3f\t-\t%.1f\t-\n",
+	  scan->number, scan->start, scan->end, (double)scan->start/scan->rate,
+	  (double)(scan->end-scan->start)/scan->rate, level);
+  cosby_print("Record %d at %.1fs, %.1fs long, %.1fdB\n", scan->number,
+	      (double)scan->start/scan->rate, (double)(scan->end-scan->start)/scan->rate,
+	      level);
+}
+
+int scan_recording(char *wave_filename, char *index_name) {
+  void *in_file;
+  int (*read_samples)(void *device, double *buffer, size_t count);
+  void (*close_input)(void *device);
+  struct scan scan;
+  struct analyzer analyzer;
+  double *window;
+  double *audio;
+  double power_sq;
+  double power_diff;
+  size_t wavelength;
+  size_t block_size;
+  size_t position = 0;
+  int simd;
+  int count;
+  int windows;
+  int tones;
+  int ones;
+
+  if (init_file_input(&in_file,&read_samples,&close_input,&scan.rate,wave_filename) < 0)
+    return -1;
+  scan.index = fopen(index_name, "w");
+  if (scan.index == NULL) {
+    cosby_print_err("Couldn't open %s\n",index_name);
+    close_input(in_file);
+    return -1;
+  }
+
+  simd = detect_simd();
+  if (simd > settings.simd)
+    simd = settings.simd;
+  if (simd < SIMD_SCALAR)
+    simd = SIMD_SCALAR;
+  wavelength = (size_t)(scan.rate/(double)ZERO_FREQ+0.5);
+  block_size = (size_t)(SCAN_BLOCK_TIME*scan.rate);
+  window = make_window(wavelength);
+  audio = malloc(sizeof(double)*block_size);
+  if (window == NULL || audio == NULL ||
+      init_analyzer(&analyzer, window, wavelength, ENGINE_DIRECT, PRECISION_DOUBLE,
+		    simd, PLAN_ESTIMATE, 0)) {
+    cosby_print_err("Couldn't set up the scan\n");
+    return -1;
+  }
+  scan.full_scale_power_sq = full_scale_power(window, wavelength);
+  scan.number = 0;
+  scan.in_record = 0;
+  fprintf(scan.index, "# record\tstart\tend\tstart seconds\tseconds\tbytes\tlevel dB\tfile\n");
+
+  while ((count = (*read_samples)(in_file, audio, block_size)) > 0) {
+    windows = tones = ones = 0;
+    for (int c=0;c+wavelength<=count;c+=wavelength) {
+      windows++;
+      if (is_tone(&analyzer, audio+c, &power_sq, &power_diff)) {
+	tones++;
+	if (power_diff < 0.0)
+	  ones++;
+	if (scan.in_record) {
+	  scan.power_total += power_sq;
+	  scan.power_count++;
+	}
+      }
+    }
+    if (windows > 0 && 2*tones >= windows) {
+      if (!scan.in_record) {
+	scan.in_record = 1;
+	scan.has_ones = 0;
+	scan.start = position;
+	scan.power_total = 0.0;
+	scan.power_count = 0;
+      }
+      if (ones >= QUIET_MIN_ONES)
+	scan.has_ones = 1;
+      scan.end = position+count;
+    } else if (scan.in_record && position+count-scan.end >= SCAN_GAP_TIME*scan.rate) {
+      end_scanned_record(&scan);
+    }
+    position += count;
+  }
+  if (scan.in_record)
+    end_scanned_record(&scan);
+  cosby_print("Found %d records in %.1fs\n", scan.number, (double)position/scan.rate);
+
+  fclose(scan.index);
+  free_analyzer(&analyzer);
+  fftw_free(window);
+  free(audio);
+  close_input(in_file);
+  return 1;
+}
+
+/* Random access.
+
+Once we know where the records are, they have nothing to do with
+each other. So, with --index, each record gets its own decoder, which
+starts reading right before where the index says the record starts.
+With --record=, that's the only one that gets decoded. Otherwise,
+every record in the index gets decoded into its own numbered file,
+--threads of them at once. */
+struct indexed_record {
+  int number;
+  size_t start;
+  size_t end;
+  char *wave_filename;
+  char *data_filename;
+  struct output_sink out;
+  struct cosby_decoder *decoder;
+  long long bytes;
+  int framed;
+  double level;
+};
+
+/* Reads the records out of an index. Returns how many there are, or
+   -1 if it couldn't. */
+int read_index(char *index_name, struct indexed_record **records) {
+  FILE *index;
+  char line[4096];
+  int num_records = 0;
+  struct indexed_record record;
+
+  if ((index = fopen(index_name,"r")) == NULL) {
+    cosby_print_err("Couldn't open %s\n",index_name);
+    return -1;
+  }
+  (*records) = NULL;
+  while (fgets(line, sizeof(line), index) != NULL) {
+    if (line[0] == '#' || sscanf(line, "%d %zu %zu", &record.number,
+				 &record.start, &record.end) != 3)
+      continue;
+    (*records) = realloc(*records, sizeof(struct indexed_record)*(num_records+1));
+    if ((*records) == NULL) {
+      fclose(index);
+      return -1;
+    }
+    (*records)[num_records++] = record;
+  }
+  fclose(index);
+  return num_records;
+}
+
+/* Moves the input to sample number sample */
+int seek_input(void *in_file, void (*close_input)(void *device), size_t sample) {
+  struct mapped_input *input;
+  size_t page = sysconf(_SC_PAGESIZE);
+  if (close_input == &close_mapped_input) {
+    input = (struct mapped_input *)in_file;
+    if (sample > input->frames)
+      sample = input->frames;
+    input->pos = sample;
+    input->released = (input->samples-input->map+sample*2)/page*page;
+    return 0;
+  }
+  return sf_seek((SNDFILE *)in_file, sample, SEEK_SET) < 0 ? -1 : 0;
+}
+
+void indexed_bytes(void *user, const unsigned char *bytes, size_t count) {
+  struct indexed_record *record = (struct indexed_record *)user;
+  sink_write(&record->out, bytes, count);
+  record->bytes += count;
+}
+
+void indexed_event(void *user, int event, size_t offset) {
+  struct indexed_record *record = (struct indexed_record *)user;
+  if (event == COSBY_EVENT_FRAMED)
+    record->framed = 1;
+  else if (event == COSBY_EVENT_DONE)
+    record->level = cosby_decoder_level(record->decoder);
+}
+
+/* Decodes one record. This runs in a bunch of threads at once, so
+   each one opens the recording for itself. */
+int decode_indexed_record(struct indexed_record *record) {
+  void *in_file;
+  int (*read_samples)(void *device, double *buffer, size_t count);
+  void (*close_input)(void *device);
+  struct cosby_settings record_settings = settings;
+  double *buffer;
+  size_t room;
+  size_t position;
+  size_t end;
+  int count;
+
+  record->bytes = 0;
+  record->framed = 0;
+  record->level = -INFINITY;
+  if (init_file_input(&in_file,&read_samples,&close_input,
+		      &record_settings.input_rate,record->wave_filename) < 0)
+    return -1;
+  position = (size_t)(INDEX_LEAD_TIME*record_settings.input_rate);
+  position = (record->start > position) ? record->start-position : 0;
+  end = record->end+(size_t)(INDEX_LEAD_TIME*record_settings.input_rate);
+  if (seek_input(in_file, close_input, position) < 0) {
+    cosby_print_err("Couldn't find record %d in %s\n",record->number,record->wave_filename);
+    close_input(in_file);
+    return -1;
+  }
+
+  record->decoder = cosby_decoder_new(&record_settings, &indexed_bytes, &indexed_event, record);
+  if (record->decoder == NULL) {
+    cosby_print_err("Couldn't set up the decoder\n");
+    close_input(in_file);
+    return -1;
+  }
+
+  /* The decoder stops by itself at the end of the record. Past the
+     end of where the index says it is, there's nothing to find. */
+  while (position < end && !interrupted) {
+    buffer = cosby_decoder_buffer(record->decoder, &room);
+    if (room > AUDIO_READ_SIZE)
+      room = AUDIO_READ_SIZE;
+    if (room > end-position)
+      room = end-position;
+    count = (*read_samples)(in_file, buffer, room);
+    if (count > 0 && cosby_decoder_commit(record->decoder, count))
+      break;
+    flush_if_requested(&record->out);
+    position += count;
+    if (count < (int)room || position >= end) {
+      cosby_decoder_finish(record->decoder);
+      break;
+    }
+  }
+  if (record->level == -INFINITY)
+    record->level = cosby_decoder_level(record->decoder);
+
+  cosby_decoder_free(record->decoder);
+  close_input(in_file);
+  return 0;
+}
+
+/* Does count jobs, --threads of them at once. The threads take the
+   next job nobody's started on until there aren't any left. */
+struct workers {
+  void (*work)(void *jobs, int n);
+  void *jobs;
+  int count;
+  int next;
+  pthread_mutex_t lock;
+};
+
+void *run_worker(void *arg) {
+  struct workers *workers = (struct workers *)arg;
+  int next;
+  for (;;) {
+    pthread_mutex_lock(&workers->lock);
+    next = workers->next++;
+    pthread_mutex_unlock(&workers->lock);
+    if (next >= workers->count || interrupted)
+      break;
+    workers->work(workers->jobs, next);
+  }
+  return NULL;
+}
+
+void run_in_threads(int count, void (*work)(void *jobs, int n), void *jobs) {
+  struct workers workers;
+  pthread_t *threads;
+  int num_threads = decode_threads;
+  int started = 0;
+
+  if (num_threads > count)
+    num_threads = count;
+  workers.work = work;
+  workers.jobs = jobs;
+  workers.count = count;
+  workers.next = 0;
+  pthread_mutex_init(&workers.lock, NULL);
+  threads = malloc(sizeof(pthread_t)*num_threads);
+  for (int c=1;c<num_threads && threads != NULL;c++) {
+    if (pthread_create(&threads[started], NULL, &run_worker, &workers) == 0)
+      started++;
+  }
+  /* This thread pitches in too */
+  run_worker(&workers);
+  for (int c=0;c<started;c++) {
+    pthread_join(threads[c], NULL);
+  }
+  free(threads);
+  pthread_mutex_destroy(&workers.lock);
+}
+
+void decode_record_job(void *records, int n) {
+  decode_indexed_record(&((struct indexed_record *)records)[n]);
+}
+
+int record_from_index(char *data_filename, char *wave_filename) {
+  struct indexed_record *records;
+  char *index_name = index_filename;
+  char *base = NULL;
+  char *extension = "";
+  int num_records;
+  int found = -1;
+  int decoded = 0;
+
+  if (wave_filename == NULL) {
+    cosby_print_err("Decoding from an index needs a recording to find the records in\n");
+    return -1;
+  }
+  if (index_name == NULL)
+    index_name = index_name_for(wave_filename);
+  if (index_name == NULL || (num_records = read_index(index_name, &records)) < 0)
+    return -1;
+
+  /* Just the one we want */
+  if (index_record > 0) {
+    for (int c=0;c<num_records;c++) {
+      if (records[c].number == index_record)
+	found = c;
+    }
+    if (found < 0) {
+      cosby_print_err("There's no record %d in %s\n",index_record,index_name);
+      free(records);
+      return -1;
+    }
+    records[0] = records[found];
+    num_records = 1;
+  } else if (data_filename == NULL) {
+    cosby_print_err("Decoding every record needs a file name to number them after\n");
+    free(records);
+    return -1;
+  } else {
+    /* Every record gets named the same way --records would name it */
+    base = name_base(data_filename, &extension);
+  }
+
+  for (int c=0;c<num_records;c++) {
+    records[c].wave_filename = wave_filename;
+    if (index_record > 0) {
+      records[c].data_filename = data_filename;
+    } else {
+      records[c].data_filename = malloc(strlen(data_filename)+16);
+      sprintf(records[c].data_filename, "%s-%02d%s", base, records[c].number, extension);
+    }
+    if (sink_open(&records[c].out, records[c].data_filename) < 0)
+      return -1;
+  }
+
+  run_in_threads(num_records, &decode_record_job, records);
+
+  for (int c=0;c<num_records;c++) {
+    if (records[c].framed) {
+      got_signal = 1;
+      decoded++;
+    }
+    sink_close(&records[c].out);
+    cosby_print("Record %d: %lld bytes, %.1fdB -> %s\n", records[c].number,
+		records[c].bytes, records[c].level,
+		records[c].data_filename ? records[c].data_filename : "stdout");
+    if (index_record == 0)
+      free(records[c].data_filename);
+  }
+  cosby_print("Decoded %d of %d records\n",decoded,num_records);
+  if (index_name != index_filename)
+    free(index_name);
+  free(base);
+  free(records);
+  return 1;
+}
+
+/* Soft decisions.
+
+Everything after the analyzer is cheap: deciding where the signal
+ends, where the line between a "0" and a "1" is, and how long to wait
+before it's the same bit again. The analyzer is where all the time
+goes. So, when a bad tape needs some fiddling with --signal-range and
+friends, "cosby soft" runs the analyzer over the whole recording just
+once, and saves the power of every window in a soft decision file.
+Give press record one of those instead of a recording, and it goes
+right to the back end. Every try takes a blink instead of a whole
+decode.
+
+The file starts with "COSBYSFT", the rate the decoder worked at and
+the version, as 32 bit little endian numbers. Then there are two 32
+bit little endian floats for each window, the power and the power
+difference. Window n starts at sample n. The whole thing gets mapped
+into memory to read it. */
+#define SOFT_MAGIC "COSBYSFT"
+#define SOFT_VERSION 1
+#define SOFT_HEADER_SIZE 16
+#define SOFT_WINDOW_SIZE 8
+
+void put_little_endian(unsigned char *bytes, unsigned int value, int size) {
+  for (int c=0;c<size;c++) {
+    bytes[c] = value & 0xff;
+    value >>= 8;
+  }
+}
+
+void put_soft_float(unsigned char *bytes, double value) {
+  float single = (float)value;
+  unsigned int word;
+  memcpy(&word, &single, 4);
+  put_little_endian(bytes, word, 4);
+}
+
+double soft_float_at(unsigned char *bytes) {
+  unsigned int word = little_endian_at(bytes, 4);
+  float single;
+  memcpy(&single, &word, 4);
+  return single;
+}
+
+void save_power(void *sink, const double *power_sq, const double *power_diff, size_t count) {
+  unsigned char bytes[SOFT_WINDOW_SIZE*FFT_BATCH_SIZE];
+  size_t chunk;
+  while (count > 0) {
+    chunk = (count > FFT_BATCH_SIZE) ? FFT_BATCH_SIZE : count;
+    for (int c=0;c<chunk;c++) {
+      put_soft_float(bytes+c*SOFT_WINDOW_SIZE, power_sq[c]);
+      put_soft_float(bytes+c*SOFT_WINDOW_SIZE+4, power_diff[c]);
+    }
+    sink_write((struct output_sink *)sink, bytes, chunk*SOFT_WINDOW_SIZE);
+    power_sq += chunk;
+    power_diff += chunk;
+    count -= chunk;
+  }
+}
+
+/* Runs the analyzer over all of a recording, and puts what it found
+   in out, soft decision file and all */
+int run_front_end(char *wave_filename, struct output_sink *out) {
+  void *in_file;
+  int (*read_samples)(void *device, double *buffer, size_t count);
+  void (*close_input)(void *device);
+  struct cosby_decoder *decoder;
+  struct cosby_settings soft_settings = settings;
+  struct sigaction old_action;
+  unsigned char header[SOFT_HEADER_SIZE];
+  double *buffer;
+  size_t room;
+  int count;
+
+  if (init_file_input(&in_file,&read_samples,&close_input,
+		      &soft_settings.input_rate,wave_filename) < 0)
+    return -1;
+
+  /* Every window, right to the end, even after the signal's over */
+  soft_settings.timing = TIMING_SAMPLE;
+  soft_settings.skip_quiet = 0;
+  soft_settings.keep_going = 1;
+  decoder = cosby_decoder_new(&soft_settings, NULL, NULL, out);
+  if (decoder == NULL) {
+    cosby_print_err("Couldn't set up the decoder\n");
+    close_input(in_file);
+    return -1;
+  }
+  decoder->on_power = &save_power;
+
+  memcpy(header, SOFT_MAGIC, 8);
+  put_little_endian(header+8, soft_settings.rate, 4);
+  put_little_endian(header+12, SOFT_VERSION, 4);
+  sink_write(out, header, SOFT_HEADER_SIZE);
+
+  catch_interrupts(&old_action);
+  if (decode_threads <= 1 || close_input != &close_mapped_input ||
+      soft_settings.input_rate != soft_settings.rate ||
+      decode_in_parallel(decoder, (struct mapped_input *)in_file) < 0) {
+    for (;;) {
+      buffer = cosby_decoder_buffer(decoder, &room);
+      if (room > AUDIO_READ_SIZE)
+	room = AUDIO_READ_SIZE;
+      count = (*read_samples)(in_file, buffer, room);
+      if (count > 0)
+	cosby_decoder_commit(decoder, count);
+      if (count < (int)room || interrupted) {
+	cosby_decoder_finish(decoder);
+	break;
+      }
+    }
+  }
+  sigaction(SIGINT, &old_action, NULL);
+  cosby_print("Analyzed %zu windows\n", decoder->offset);
+
+  close_input(in_file);
+  cosby_decoder_free(decoder);
+  return 0;
+}
+
+int save_soft(char *soft_filename, char *wave_filename) {
+  struct output_sink out;
+  int result;
+  if (sink_open(&out, soft_filename) < 0)
+    return -1;
+  result = run_front_end(wave_filename, &out);
+  sink_close(&out);
+  return (result < 0) ? -1 : 1;
+}
+
+struct soft_input {
+  unsigned char *map;
+  size_t map_length;
+  size_t count;
+};
+
+/* Returns 0 if filename is a soft decision file, and sets *rate to
+   the rate it was made at. Otherwise, -1. */
+int init_soft_input(void **in_file, int *rate, char *filename) {
+  struct soft_input *soft;
+  struct stat file_stat;
+  int fd;
+
+  if ((fd = open(filename, O_RDONLY)) < 0)
+    return -1;
+  if (fstat(fd, &file_stat) < 0 || file_stat.st_size < SOFT_HEADER_SIZE ||
+      (soft = malloc(sizeof(struct soft_input))) == NULL) {
+    close(fd);
+    return -1;
   }
-  power_sq_totals = fftw_malloc(sizeof(double)*(POWER_SQ_TOTALS_SIZE*DEFAULT_SYMBOL_LENGTH));
-  if (power_sq_totals == NULL)
-    return 1;
-  for (int c=0;c<POWER_SQ_TOTALS_SIZE*DEFAULT_SYMBOL_LENGTH;c++) {
-    power_sq_totals[c] = 0.0;
+  soft->map_length = file_stat.st_size;
+  soft->map = mmap(NULL, soft->map_length, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (soft->map == MAP_FAILED) {
+    free(soft);
+    return -1;
+  }
+  if (0!=memcmp(soft->map, SOFT_MAGIC, 8) ||
+      little_endian_at(soft->map+12, 4) != SOFT_VERSION) {
+    munmap(soft->map, soft->map_length);
+    free(soft);
+    return -1;
   }
+  (*rate) = little_endian_at(soft->map+8, 4);
+  soft->count = (soft->map_length-SOFT_HEADER_SIZE)/SOFT_WINDOW_SIZE;
+  madvise(soft->map, soft->map_length, MADV_SEQUENTIAL);
+  (*in_file) = (void *)soft;
   return 0;
+}
 
+void close_soft_input(void *in_file) {
+  struct soft_input *soft = (struct soft_input *)in_file;
+  munmap(soft->map, soft->map_length);
+  free(soft);
 }
 
-/* This is a circular buffer. That means, if you reach the end,
-you just start again at the beginning. */
-int init_audio_buffer(int (*read_samples)(void *device, double *buffer, size_t count), void *in_file) {
-  audio_buffer_offset = 0;
-  audio_buffer_length = 0;
-  audio_buffer_section = 0;
-  audio_eof = 0;
-  audio_buffer = (double*)fftw_malloc(sizeof(double)*AUDIO_BUFFER_SIZE);
-  if (audio_buffer != NULL) {
-    audio_buffer_length = (*read_samples)(in_file, audio_buffer, AUDIO_BUFFER_SIZE);
-    if (audio_buffer_length != AUDIO_BUFFER_SIZE) {
-      audio_eof = 1;
-    }
+/* Runs just the back end, on what the analyzer found last time */
+void reslice(struct cosby_decoder *decoder, struct soft_input *soft) {
+  unsigned char *window = soft->map+SOFT_HEADER_SIZE;
+  int stage = stats_enter(decoder->stats, STAGE_SLICE);
+  for (size_t n=0;n<soft->count && !decoder->done && !interrupted;n++) {
+    process_power(decoder, soft_float_at(window), soft_float_at(window+4));
+    decoder->offset++;
+    window += SOFT_WINDOW_SIZE;
+    flush_if_requested(recording_sink);
+  }
+  flush_decoder_output(decoder);
+  stats_enter(decoder->stats, stage);
+  if (decoder->stats != NULL)
+    decoder->stats->samples += decoder->offset;
+}
+
+/* Sweeping.
+
+A tape that barely won't decode might decode with a different
+--signal-range or --threshold, but which one? Give any of the tuning
+options a list, like --signal-range=8,16,32, and "cosby sweep" tries
+every combination of them. The analyzer only runs once, or not at
+all if you give it a soft decision file. Then every combination gets
+its own back end, --threads of them at a time, all reading the same
+soft decisions out of memory.
+
+It prints how each one did: whether it found the data, how many
+bytes it got, and how long the data went on for. Usually a lot of
+them come out exactly the same, so it says which. */
+struct sweep_run {
+  struct cosby_settings settings;
+  struct soft_input *soft;
+  struct output_sink out;
+  struct cosby_decoder *decoder;
+  int failed;
+  int framed;
+  size_t start;
+  size_t end;
+  double level;
+  int same_as;
+};
+
+/* Reads a list like "8,16,32". Returns how many numbers there are.
+   Without a list, it's just value. */
+int parse_list(char *list, double value, double **values) {
+  char *end;
+  int count = 0;
+  (*values) = malloc(sizeof(double)*(list ? strlen(list)+1 : 1));
+  if ((*values) == NULL)
     return 0;
-  } else {
+  if (list == NULL) {
+    (*values)[0] = value;
     return 1;
   }
+  for (;;) {
+    (*values)[count] = strtod(list, &end);
+    if (end == list)
+      break;
+    count++;
+    if (*end != ',')
+      break;
+    list = end+1;
+  }
+  return count;
 }
 
-/* free up those resources */
-void free_audio_buffer(SNDFILE *in_file) {
-  sf_close(in_file);
-  fftw_free(audio_buffer);
-}
-void free_history() {
-  fftw_free(power_diffs);
-  fftw_free(power_sq_totals);
-}
-void free_window() {
-  fftw_free(window);
+void sweep_bytes(void *user, const unsigned char *bytes, size_t count) {
+  sink_write(&((struct sweep_run *)user)->out, bytes, count);
 }
 
-/* 
-    This function puts length samples of audio starting at offset,
-    into out, and returns the number of samples read.
+void sweep_event(void *user, int event, size_t offset) {
+  struct sweep_run *run = (struct sweep_run *)user;
+  if (event == COSBY_EVENT_FRAMED) {
+    run->framed = 1;
+    run->start = offset;
+  } else if (event == COSBY_EVENT_DONE) {
+    run->end = offset;
+    run->level = cosby_decoder_level(run->decoder);
+  }
+}
 
-    This is why C is fun. This function returns samples for either an
-    audio device or an audio file.  The calling function passes in an
-    appropriate read_samples.
-   
-    It's pretty complicated and inefficient because it copies over
-    bytes from the circular buffer, rather than using a more complex
-    data structure that wouldn't require copying.
+void run_sweep_job(void *runs, int n) {
+  struct sweep_run *run = &((struct sweep_run *)runs)[n];
+  run->framed = 0;
+  run->level = -INFINITY;
+  run->end = run->soft->count;
+  if (sink_open_memory(&run->out) < 0) {
+    run->failed = 1;
+    return;
+  }
+  run->decoder = cosby_decoder_new(&run->settings, &sweep_bytes, &sweep_event, run);
+  if (run->decoder == NULL) {
+    run->failed = 1;
+    return;
+  }
+  reslice(run->decoder, run->soft);
+  if (!run->decoder->done)
+    run->level = cosby_decoder_level(run->decoder);
+  cosby_decoder_free(run->decoder);
+}
 
-    Since this doesn't use much CPU power relative to the FFT, I
-    figure it's better to be inefficient.
-*/
+int sweep(char *input) {
+  struct soft_input *soft;
+  struct soft_input analyzed;
+  struct output_sink front_end;
+  struct sweep_run *runs;
+  struct cosby_settings sweep_settings = settings;
+  double *ranges;
+  double *averages;
+  double *thresholds;
+  double *repeats;
+  int num_ranges;
+  int num_averages;
+  int num_thresholds;
+  int num_repeats;
+  int num_runs = 0;
+  int framed = 0;
+  int different = 0;
+  struct sweep_run *run;
+
+  num_ranges = parse_list(sweep_signal_range, settings.signal_range, &ranges);
+  num_averages = parse_list(sweep_power_average, settings.power_average, &averages);
+  num_thresholds = parse_list(sweep_threshold, settings.threshold, &thresholds);
+  num_repeats = parse_list(sweep_repeat_after, settings.repeat_after, &repeats);
+  if (num_ranges*num_averages*num_thresholds*num_repeats == 0) {
+    cosby_print_err("There's nothing to try\n");
+    return -1;
+  }
 
-int audio_at_offset(
-            int (*read_samples)(void *device, double *buffer, size_t count),
-	    void *in_file, double *out, size_t offset, size_t length) {
-  int count;
-  if (length > AUDIO_BUFFER_SIZE)
-    return -1; /* Buffer too small */
-
-  if (offset < audio_buffer_offset)
-    return -1; /* No going backwards in the file */
-
-
-  /* Loop as long as we still need to read from the file */
-  while (!audio_eof &&
-      (audio_buffer_offset+audio_buffer_length) < (offset+length)) {
-
-    /* We're starting in the second section */
-    if (audio_buffer_section == 1) {
-      count = (*read_samples)(in_file, audio_buffer+AUDIO_BUFFER_SIZE/2,
-			     AUDIO_BUFFER_SIZE/2);
-      audio_buffer_section = 0;
-      audio_buffer_offset+=AUDIO_BUFFER_SIZE/2;
-      if (count < AUDIO_BUFFER_SIZE/2) {
-	audio_eof = 1;
-	audio_buffer_length -= (AUDIO_BUFFER_SIZE/2-count);
-      }
-    } else {
-      count = (*read_samples)(in_file, audio_buffer,
-			     AUDIO_BUFFER_SIZE/2);
-      audio_buffer_offset+=AUDIO_BUFFER_SIZE/2;
-      audio_buffer_section = 1;
-      if (count < AUDIO_BUFFER_SIZE/2) {
-	audio_eof = 1;
-	audio_buffer_length -= (AUDIO_BUFFER_SIZE/2-count);
+  /* Use the soft decisions we've got, or work them out */
+  if (init_soft_input((void **)&soft, &sweep_settings.rate, input) < 0) {
+    if (sink_open_memory(&front_end) < 0 || run_front_end(input, &front_end) < 0)
+      return -1;
+    analyzed.map = front_end.buffer;
+    analyzed.map_length = front_end.length;
+    analyzed.count = (front_end.length-SOFT_HEADER_SIZE)/SOFT_WINDOW_SIZE;
+    sweep_settings.rate = little_endian_at(front_end.buffer+8, 4);
+    soft = &analyzed;
+  }
+  /* The back ends don't use their analyzers at all */
+  sweep_settings.input_rate = sweep_settings.rate;
+  sweep_settings.engine = ENGINE_DIRECT;
+  sweep_settings.precision = PRECISION_DOUBLE;
+  sweep_settings.timing = TIMING_SAMPLE;
+  sweep_settings.skip_quiet = 0;
+  sweep_settings.keep_going = 0;
+
+  runs = calloc(num_ranges*num_averages*num_thresholds*num_repeats, sizeof(struct sweep_run));
+  if (runs == NULL)
+    return -1;
+  for (int r=0;r<num_ranges;r++) {
+    for (int a=0;a<num_averages;a++) {
+      for (int t=0;t<num_thresholds;t++) {
+	for (int p=0;p<num_repeats;p++) {
+	  run = &runs[num_runs++];
+	  run->settings = sweep_settings;
+	  run->settings.signal_range = ranges[r];
+	  run->settings.power_average = averages[a];
+	  run->settings.threshold = thresholds[t];
+	  run->settings.repeat_after = repeats[p];
+	  run->soft = soft;
+	}
       }
     }
   }
-  /* If we're on the first section, just copy the bytes over */
-  if (audio_buffer_section == 0) {
-
-    /* There aren't enough bytes left, fill the remainder with zeros */
-    if (audio_buffer_length+audio_buffer_offset-offset<length) {
-      count = audio_buffer_length+audio_buffer_offset-offset;
-      memcpy(out, audio_buffer+offset-audio_buffer_offset, count*sizeof(double));
-      memset(out+count,0,(length-count)*sizeof(double));
-      return count;
-    } else { /* There are enough bytes, just copy it and be done */
-      memcpy(out, audio_buffer+offset-audio_buffer_offset, length*sizeof(double));
-      return length;
+  cosby_print("Trying %d combinations on %.1fs of audio\n", num_runs,
+	      (double)soft->count/sweep_settings.rate);
+  run_in_threads(num_runs, &run_sweep_job, runs);
+
+  cosby_print("\n     range  average  threshold  repeat      bytes  seconds    level\n");
+  for (int n=0;n<num_runs;n++) {
+    run = &runs[n];
+    run->same_as = -1;
+    for (int m=0;m<n && run->same_as < 0;m++) {
+      if (run->framed && runs[m].framed && run->out.length == runs[m].out.length &&
+	  0==memcmp(run->out.buffer, runs[m].out.buffer, run->out.length))
+	run->same_as = m;
     }
-  } else { /* We're in the second section, it's more complicated */
-
-     /* Find the total number of bytes to copy */
-    if (audio_buffer_length+audio_buffer_offset-offset<length)
-      count = audio_buffer_length+audio_buffer_offset-offset;
-    else
-      count = length;
-
-    /* We're starting in the second section */
-    if (offset-audio_buffer_offset<AUDIO_BUFFER_SIZE/2) {
-      /* and it wraps around. */
-      if (offset-audio_buffer_offset+count>AUDIO_BUFFER_SIZE/2) {
-  	memcpy(out, audio_buffer+AUDIO_BUFFER_SIZE/2+offset-audio_buffer_offset,
-  	       (AUDIO_BUFFER_SIZE/2-(offset-audio_buffer_offset))*sizeof(double));
-  	memcpy(out+AUDIO_BUFFER_SIZE/2-(offset-audio_buffer_offset),
-	       audio_buffer,(count-(AUDIO_BUFFER_SIZE/2-
-  				    (offset-audio_buffer_offset)))*sizeof(double));
-      } else { /* it doesn't wrap around */
-  	memcpy(out, audio_buffer+AUDIO_BUFFER_SIZE/2+offset-audio_buffer_offset,
-  	       count*sizeof(double));
-      }
-    } else { /* We're starting in the first section, just copy and be done */
-      memcpy(out, audio_buffer+offset-audio_buffer_offset-AUDIO_BUFFER_SIZE/2, count*sizeof(double));
+    cosby_print("%3d %6.1f %8.1f %10.3f %7.2f  ", n+1, run->settings.signal_range,
+		run->settings.power_average, run->settings.threshold,
+		run->settings.repeat_after);
+    if (run->failed) {
+      cosby_print("couldn't try it\n");
+    } else if (!run->framed) {
+      cosby_print("no data\n");
+    } else {
+      cosby_print("%9zu %8.2f %6.1fdB", run->out.length,
+		  (double)(run->end-run->start)/sweep_settings.rate, run->level);
+      if (run->same_as >= 0)
+	cosby_print("  same as %d", run->same_as+1);
+      cosby_print("\n");
+      framed++;
+      if (run->same_as < 0)
+	different++;
     }
-    memset(out+count,0,(length-count)*sizeof(double));
-    return count;
   }
+  cosby_print("\n%d of %d found the data, with %d different results\n",
+	      framed, num_runs, different);
+
+  for (int n=0;n<num_runs;n++) {
+    if (runs[n].out.buffer != NULL)
+      sink_close(&runs[n].out);
+  }
+  free(runs);
+  free(ranges);
+  free(averages);
+  free(thresholds);
+  free(repeats);
+  if (soft == &analyzed)
+    sink_close(&front_end);
+  else
+    close_soft_input(soft);
+  return 1;
 }
 
-int read_from_file(void *in_file, double *buffer, size_t count) {
-  return sf_read_double((SNDFILE *)in_file, buffer, count);
+/* The result cache.
+
+Every night, somebody decodes the whole archive again to make sure
+it still decodes, and almost none of it has changed since last time.
+With --cache, once a recording is decoded, the output gets saved in
+~/.cache/cosby/results, under a hash of the recording, the settings
+that can change what comes out, and the copy of cosby that did it.
+The next time the same recording gets decoded the same way, it comes
+right out of the cache, without decoding anything.
+
+The copy of cosby is when it was built, so rebuilding it starts over
+with an empty cache. That's the only way to be sure a change to the
+decoder can't hand back a stale result. The hash is 64 bit FNV-1a,
+which is simple and plenty fast compared to decoding. It's safe to
+delete the cache whenever you like. */
+#define CACHE_BUILD __DATE__ " " __TIME__
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+unsigned long long fnv1a(unsigned long long hash, const void *data, size_t length) {
+  const unsigned char *bytes = (const unsigned char *)data;
+  for (size_t c=0;c<length;c++) {
+    hash ^= bytes[c];
+    hash *= FNV_PRIME;
+  }
+  return hash;
 }
 
-int read_from_mic(void *device, double *samples, size_t count) {
-  static size_t total_read=0;
-  short short_samples[AUDIO_BUFFER_SIZE*2];
-  int err;
-  /*  char c; */
+/* ~/.cache/cosby, or wherever XDG_CACHE_HOME says. With create, it
+   makes it if it isn't there yet. Returns NULL if there's nowhere to
+   put it. */
+char *cache_dir(int create) {
+  char *dir;
+  if (getenv("XDG_CACHE_HOME") != NULL && getenv("XDG_CACHE_HOME")[0] != 0) {
+    dir = malloc(strlen(getenv("XDG_CACHE_HOME"))+8);
+    if (dir == NULL)
+      return NULL;
+    sprintf(dir, "%s", getenv("XDG_CACHE_HOME"));
+  } else if (getenv("HOME") != NULL) {
+    dir = malloc(strlen(getenv("HOME"))+16);
+    if (dir == NULL)
+      return NULL;
+    sprintf(dir, "%s/.cache", getenv("HOME"));
+  } else {
+    return NULL;
+  }
+  if (create)
+    mkdir(dir, 0777);
+  strcat(dir, "/cosby");
+  if (create && mkdir(dir, 0777) < 0 && errno != EEXIST) {
+    free(dir);
+    return NULL;
+  }
+  return dir;
+}
 
-  /* FIXME: add manual keyboard shutdown */
-  /* if (read(STDIN_FILENO,&c,1) != 0) */
-  /*   return 1; */
+/* Where the cached result for key goes, with suffix on the end.
+   Returns NULL if there's nowhere. */
+char *cache_filename(unsigned long long key, char *suffix) {
+  char *dir = cache_directory;
+  char *name;
+  if (dir == NULL) {
+    if ((dir = cache_dir(1)) == NULL)
+      return NULL;
+    dir = realloc(dir, strlen(dir)+16);
+    strcat(dir, "/results");
+  }
+  mkdir(dir, 0777);
+  name = malloc(strlen(dir)+strlen(suffix)+24);
+  if (name != NULL)
+    sprintf(name, "%s/%016llx%s", dir, key, suffix);
+  if (dir != cache_directory)
+    free(dir);
+  return name;
+}
 
-  if (count>AUDIO_BUFFER_SIZE) {
-    cosby_print_err("Reading too much\n");
-    return -1;
+/* Hashes the recording and everything else that goes into what
+   comes out of it. Returns 0 if it can't read the recording. */
+unsigned long long cache_key(char *wave_filename) {
+  unsigned long long hash = FNV_OFFSET_BASIS;
+  unsigned char buffer[65536];
+  struct stat file_stat;
+  ssize_t count;
+  int fd;
+
+  /* Only plain files. Hashing a pipe would use up the recording. */
+  if (stat(wave_filename, &file_stat) < 0 || !S_ISREG(file_stat.st_mode) ||
+      (fd = open(wave_filename, O_RDONLY)) < 0)
+    return 0;
+  hash = fnv1a(hash, CACHE_BUILD, strlen(CACHE_BUILD));
+  hash = fnv1a(hash, &settings.engine, sizeof(settings.engine));
+  hash = fnv1a(hash, &settings.rate, sizeof(settings.rate));
+  hash = fnv1a(hash, &settings.precision, sizeof(settings.precision));
+  hash = fnv1a(hash, &settings.timing, sizeof(settings.timing));
+  hash = fnv1a(hash, &settings.signal_range, sizeof(settings.signal_range));
+  hash = fnv1a(hash, &settings.power_average, sizeof(settings.power_average));
+  hash = fnv1a(hash, &settings.threshold, sizeof(settings.threshold));
+  hash = fnv1a(hash, &settings.repeat_after, sizeof(settings.repeat_after));
+  while ((count = read(fd, buffer, sizeof(buffer))) > 0 || (count < 0 && errno == EINTR)) {
+    if (count > 0)
+      hash = fnv1a(hash, buffer, count);
   }
-  if ((err = snd_pcm_readi(device,(void *)short_samples, count)) < 0) {
-    snd_pcm_prepare(device);
-    cosby_print_err("Input troubles... %d\n",err);
+  close(fd);
+  return (count < 0) ? 0 : hash;
+}
+
+/* If there's a result for key in the cache, writes it to
+   data_filename and returns 1. Otherwise 0. */
+int cached_result(unsigned long long key, char *data_filename) {
+  char *meta_name = cache_filename(key, ".meta");
+  char *data_name = cache_filename(key, ".dat");
+  struct output_sink out;
+  struct stat file_stat;
+  unsigned char *result = NULL;
+  FILE *meta = NULL;
+  int fd = -1;
+  int signal = 0;
+  long long bytes = -1;
+  unsigned long long hash = 0;
+  size_t length = 0;
+  ssize_t count = 0;
+
+  if (meta_name != NULL && data_name != NULL && (meta = fopen(meta_name, "r")) != NULL &&
+      fscanf(meta, "signal %d bytes %lld hash %llx", &signal, &bytes, &hash) == 3)
+    fd = open(data_name, O_RDONLY);
+  if (meta != NULL)
+    fclose(meta);
+  free(meta_name);
+  free(data_name);
+  if (fd < 0)
     return 0;
+
+  /* Read the whole thing in and check it before any of it goes
+     anywhere. If somebody's been messing with it, decode it after
+     all. */
+  if (fstat(fd, &file_stat) == 0 && file_stat.st_size == bytes &&
+      (result = malloc(bytes+1)) != NULL) {
+    while (length < bytes &&
+	   ((count = read(fd, result+length, bytes-length)) > 0 || (count < 0 && errno == EINTR))) {
+      if (count > 0)
+	length += count;
+    }
   }
-  for (int c=0;c<count;c++) {
-    /* Only look at the left channel, even though we get both as input */
-    samples[c] = (double)(short_samples[c*2]);
+  close(fd);
+  if (result == NULL || length != bytes ||
+      fnv1a(FNV_OFFSET_BASIS, result, length) != hash) {
+    cosby_print_err("The cached result is broken, decoding it again\n");
+    free(result);
+    return 0;
   }
-  total_read += count;
-  if (total_read > DEFAULT_SAMPLE_RATE*MAX_WAIT && !framed) {
-    cosby_print("No signal found. Giving up.\n");
-    return -2;
+
+  if (sink_open(&out, data_filename) < 0) {
+    free(result);
+    return 0;
   }
-  return count;
+  sink_write(&out, result, length);
+  sink_close(&out);
+  free(result);
+  got_signal = signal;
+  cosby_print("Found it in the cache, %lld bytes\n", bytes);
+  return 1;
 }
 
-int init_file_input(void **in_file, char *wave_filename) {
-  SF_INFO file_info;
-  memset((void *)&file_info,0,sizeof(SF_INFO));
-  (*in_file) = sf_open(wave_filename, SFM_READ, &file_info);
-  if (file_info.samplerate != DEFAULT_SAMPLE_RATE){
-    cosby_print_err("Sorry, this program is lame and only supports %d samples per second\n",DEFAULT_SAMPLE_RATE);
-    return -1;
-  } else if (file_info.channels != 1) {
-    cosby_print_err("Sorry, this program is lame and only supports mono .WAV files\n");
+/* Writes a file by writing somewhere else and renaming it, so two
+   decodes of the same thing at once can't make a mess */
+int write_cache_file(char *name, const void *data, size_t length) {
+  char *temp_name = malloc(strlen(name)+16);
+  int fd;
+  int result = -1;
+  if (temp_name == NULL)
     return -1;
+  sprintf(temp_name, "%s.%d", name, (int)getpid());
+  if ((fd = open(temp_name, O_WRONLY|O_CREAT|O_TRUNC, 0666)) >= 0) {
+    if (write(fd, data, length) == (ssize_t)length)
+      result = 0;
+    close(fd);
+    if (result == 0 && rename(temp_name, name) < 0)
+      result = -1;
+    if (result < 0)
+      unlink(temp_name);
   }
+  free(temp_name);
+  return result;
+}
 
-  return 0;
+/* The metadata goes in last, since that's what says there's a
+   result */
+void cache_result(unsigned long long key, char *wave_filename, struct output_sink *result) {
+  char *meta_name = cache_filename(key, ".meta");
+  char *data_name = cache_filename(key, ".dat");
+  char *meta = NULL;
+  if (meta_name == NULL || data_name == NULL ||
+      asprintf(&meta, "signal %d\nbytes %zu\nhash %016llx\ninput %s\nbuild %s\n", got_signal,
+	       result->length, fnv1a(FNV_OFFSET_BASIS, result->buffer, result->length),
+	       wave_filename, CACHE_BUILD) < 0 ||
+      write_cache_file(data_name, result->buffer, result->length) < 0 ||
+      write_cache_file(meta_name, meta, strlen(meta)) < 0)
+    cosby_print_err("Couldn't save the result in the cache\n");
+  free(meta);
+  free(meta_name);
+  free(data_name);
 }
-int init_mic_input(void **device) {
-  snd_pcm_hw_params_t *hwparams;
-  snd_pcm_format_t format;
-  unsigned int rate = DEFAULT_SAMPLE_RATE;
-  int err;
-  
-  snd_pcm_hw_params_alloca(&hwparams);
-  if (is_bigendian())
-    format = SND_PCM_FORMAT_S16_BE;
-  else
-    format = SND_PCM_FORMAT_S16_LE;
-  if ((err = snd_pcm_open((snd_pcm_t **)device, ALSA_AUDIO_DEVICE, SND_PCM_STREAM_CAPTURE, 0)) < 0) {
-    cosby_print_err("Uhhh... I don't think this computer has speakers (%d)\n",err);
-    return -1;
-  }
 
-  if ((err = snd_pcm_hw_params_any((snd_pcm_t *)(*device), hwparams)) < 0) {
-    cosby_print_err("Your sounds is really fd up dude. (%d)\n",err);
-    return -1;
-  }
-  if ((err = snd_pcm_hw_params_set_rate_resample((snd_pcm_t *)(*device), hwparams, 0)) < 0) {
-    cosby_print_err("Dude! I just said it's fine to resample and your soundscared freaked out on me (%d)\n",err);
-    return -1;
-  }
-  if ((err = snd_pcm_hw_params_set_format((snd_pcm_t *)(*device), hwparams, format)) < 0) {
-    cosby_print_err("Hey there. You don't support 16bit sound? Is this 1991? (%d)\n",err);
-    return -1;
-  }
-  if ((err = snd_pcm_hw_params_set_channels((snd_pcm_t *)(*device), hwparams, 2)) < 0) {
-    cosby_print_err("Dude! WTF! No stereo sound! (%d)\n",err);
-    return -1;
+/* Saying where the time went.
+
+This is for figuring out how big a computer it takes to keep up with
+a sound card, and for catching a new version being slower than the
+old one. --stats prints a table of how long each stage took, with how
+much audio went through and how many times faster than realtime that
+is. --stats=FILE adds the same thing to FILE as one JSON object per
+line instead, so a whole batch can go in one file, one line per
+recording. Each line gets written all at once, so the batch's
+decodes don't get mixed up with each other. */
+const char *stage_names[NUM_STAGES] = { "other", "read", "copy", "skip", "window",
+					"analyze", "slice", "write" };
+const char *engine_names[] = { "fft", "sdft", "direct" };
+
+/* Writes text as a JSON string */
+void put_json_string(FILE *file, const char *text) {
+  fputc('"', file);
+  for (;*text != 0;text++) {
+    if (*text == '"' || *text == '\\')
+      fprintf(file, "\\%c", *text);
+    else if ((unsigned char)*text < 0x20)
+      fprintf(file, "\\u%04x", *text);
+    else
+      fputc(*text, file);
   }
-  if ((err = snd_pcm_hw_params_set_access((snd_pcm_t *)(*device), hwparams, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
-    cosby_print_err("ALSA is seriously braindead. Consider writing a letter to the mailing list complaining. (%d)\n",err);
+  fputc('"', file);
+}
+
+int write_stats_json(struct stats *stats, char *wave_filename,
+		     struct cosby_settings *record_settings, double total, double audio) {
+  const char *precision_names[] = { "double", "float", "fixed" };
+  const char *timing_names[] = { "sample", "symbol" };
+  char *line = NULL;
+  size_t length = 0;
+  FILE *json;
+  int fd;
+  int result = -1;
+
+  if ((json = open_memstream(&line, &length)) == NULL)
     return -1;
+  fprintf(json, "{\"input\":");
+  put_json_string(json, (wave_filename == NULL) ? "" : wave_filename);
+  fprintf(json, ",\"engine\":\"%s\",\"precision\":\"%s\",\"timing\":\"%s\","
+	  "\"simd\":\"%s\",\"threads\":%d,\"input_rate\":%d,\"rate\":%d,\"seconds\":{",
+	  engine_names[stats->engine], precision_names[record_settings->precision],
+	  timing_names[record_settings->timing], simd_name(stats->simd),
+	  decode_threads, record_settings->input_rate, record_settings->rate);
+  for (int c=0;c<NUM_STAGES;c++)
+    fprintf(json, "%s\"%s\":%.6f", (c == 0) ? "" : ",", stage_names[c], stats->seconds[c]);
+  fprintf(json, "},\"total_seconds\":%.6f,\"samples\":%zu,\"audio_seconds\":%.6f,"
+	  "\"windows\":%zu,\"bits\":%zu,\"bytes\":%zu,\"records\":%zu,"
+	  "\"samples_per_second\":%.1f,\"realtime\":%.3f}\n",
+	  total, stats->samples, audio, stats->windows, stats->bits, stats->bytes,
+	  stats->records, (total > 0.0) ? stats->samples/total : 0.0,
+	  (total > 0.0) ? audio/total : 0.0);
+  fclose(json);
+
+  if ((fd = open(stats_filename, O_WRONLY|O_CREAT|O_APPEND, 0666)) >= 0) {
+    if (write(fd, line, length) == (ssize_t)length)
+      result = 0;
+    close(fd);
   }
-  if ((err = snd_pcm_hw_params_set_rate_near((snd_pcm_t *)(*device), hwparams, &rate, 0)) < 0) {
-    cosby_print_err("I think you have a sound card from 1990 (%d)\n",err);
-    return -1;
+  free(line);
+  return result;
+}
+
+void report_stats(struct stats *stats, char *wave_filename,
+		  struct cosby_settings *record_settings) {
+  double total = 0.0;
+  double audio = (double)stats->samples/record_settings->input_rate;
+
+  for (int c=0;c<NUM_STAGES;c++)
+    total += stats->seconds[c];
+  if (stats_filename != NULL) {
+    if (write_stats_json(stats, wave_filename, record_settings, total, audio) < 0)
+      cosby_print_err("Couldn't write the stats to %s\n",stats_filename);
+    return;
   }
-  if ((err = snd_pcm_hw_params((snd_pcm_t *)(*device), hwparams) < 0)) {
-    cosby_print_err("Yur soundscard is br0kn!! (%d)\n",err);
-    return -1;
+
+  cosby_print("Where the time went, with the %s engine and %s:\n",
+	      engine_names[stats->engine], simd_name(stats->simd));
+  for (int c=0;c<NUM_STAGES;c++) {
+    cosby_print("  %-8s %9.3fs %5.1f%%\n", stage_names[c], stats->seconds[c],
+		(total > 0.0) ? 100.0*stats->seconds[c]/total : 0.0);
   }
-  return 0;
+  cosby_print("  %-8s %9.3fs\n", "total", total);
+  cosby_print("%zu samples, %.1fs of audio, %zu windows\n", stats->samples, audio,
+	      stats->windows);
+  cosby_print("%zu bits, %zu bytes, %zu record%s\n", stats->bits, stats->bytes,
+	      stats->records, (stats->records == 1) ? "" : "s");
+  if (total > 0.0)
+    cosby_print("%.0f samples per second, %.1f times realtime\n", stats->samples/total,
+		audio/total);
 }
 
 int press_record(char *data_filename, char *wave_filename) {
@@ -1045,85 +5002,689 @@ int press_record(char *data_filename, char *wave_filename) {
 
 
   void *in_file;
-  FILE *out_file;
-  size_t num_harmonics;
-  sf_count_t samples_read;
-  fftw_complex *harmonics;
-  fftw_plan get_frequencies;
-  size_t offset = 0;
-  double *audio_samples;
+  struct output_sink out;
+  struct cosby_decoder *decoder;
+  struct cosby_settings record_settings = settings;
+  struct record_split split;
+  struct sigaction old_action;
+  struct output_sink cache_copy;
+  struct stats stats;
+  unsigned long long key = 0;
+  int result;
+  int stage;
+  int can_split;
+  double *buffer;
+  size_t room;
+  size_t total_read = 0;
+  int count;
   int (*read_samples)(void *device, double *buffer, size_t count);
+  void (*close_input)(void *device);
 
-  /* Initialize the FFT
-
-     If the FFT is over the wavelength of the low frequency (twice the symbol size)
+  if (index_filename != NULL || index_record > 0) {
+    catch_interrupts(&old_action);
+    result = record_from_index(data_filename, wave_filename);
+    sigaction(SIGINT, &old_action, NULL);
+    return result;
+  }
 
-     sample 0 - DC
-     sample 1 - wavelen of 2 symbols - "Zero"
-     sample 2 - wavelen of 1 symbol - "One"
+  /* The clock starts now, but nothing gets charged to anything until
+     the decoder's ready */
+  memset(&stats, 0, sizeof(stats));
+  stats.since = stats_clock();
 
-     This doesn't have a very narrow filter, so it might be susceptable to interference.     
-   */
-  num_harmonics = DEFAULT_WAVELENGTH/2+1;
-  harmonics = (fftw_complex*) fftw_malloc(sizeof(fftw_complex)*num_harmonics);
+  /* Maybe we've done this one before */
+  if (use_cache && wave_filename != NULL && !split_records &&
+      (key = cache_key(wave_filename)) != 0 && cached_result(key, data_filename))
+    return 1;
 
-  audio_samples = (double*) fftw_malloc(sizeof(double)*DEFAULT_WAVELENGTH);
   if (wave_filename == NULL) {
-    read_samples = &read_from_mic;
-    init_mic_input(&in_file);
+    read_samples = &read_from_capture;
+    close_input = &close_capture_input;
+    record_settings.input_rate = DEFAULT_SAMPLE_RATE;
+    if (init_capture_input(&in_file) < 0)
+      return -1;
+  } else if (init_soft_input(&in_file, &record_settings.rate, wave_filename) == 0) {
+    read_samples = NULL;
+    close_input = &close_soft_input;
+    record_settings.input_rate = record_settings.rate;
+  } else {
+    if (init_file_input(&in_file,&read_samples,&close_input,
+			&record_settings.input_rate,wave_filename) < 0)
+      return -1;
+  }
+
+  if (split_records) {
+    if (data_filename == NULL) {
+      cosby_print_err("Splitting up records needs a file name to number them after\n");
+      close_input(in_file);
+      return -1;
+    }
+    if (start_splitting(&split, data_filename, record_settings.rate,
+			record_settings.input_rate) < 0) {
+      close_input(in_file);
+      return -1;
+    }
+  } else if (sink_open(&out, data_filename) < 0) {
+    close_input(in_file);
+    return -1;
+  } else if (key != 0 && sink_open_memory(&cache_copy) == 0) {
+    out.tee = &cache_copy;
+  }
 
+  got_signal = 0;
+  if (split_records) {
+    record_settings.keep_going = 1;
+    decoder = cosby_decoder_new(&record_settings, &split_bytes, &split_event, &split);
+    split.decoder = decoder;
   } else {
-    read_samples = &read_from_file;
-    init_file_input(&in_file,wave_filename);
+    decoder = cosby_decoder_new(&record_settings, &record_bytes, &record_event, &out);
   }
-  init_audio_buffer(read_samples, in_file);
-  init_history();
-  init_window();
-  if (data_filename == NULL)
-    out_file = stdout;
+  if (decoder == NULL) {
+    cosby_print_err("Couldn't set up the decoder\n");
+    if (split_records) {
+      finish_splitting(&split);
+    } else {
+      sink_close(&out);
+      if (out.tee != NULL)
+	sink_close(&cache_copy);
+    }
+    close_input(in_file);
+    return -1;
+  }
+  if (show_stats) {
+    recording_stats = &stats;
+    decoder->stats = &stats;
+    decoder->analyzer.stats = &stats;
+    stats.engine = decoder->analyzer.engine;
+    stats.simd = decoder->simd;
+  }
+
+  catch_interrupts(&old_action);
+  if (!split_records)
+    recording_sink = &out;
+  can_split = close_input == &close_mapped_input &&
+    record_settings.input_rate == record_settings.rate &&
+    record_settings.timing == TIMING_SAMPLE;
+  if (close_input == &close_soft_input) {
+    reslice(decoder, (struct soft_input *)in_file);
+  } else if (decode_threads <= 1 || !can_split ||
+	     decode_in_parallel(decoder, (struct mapped_input *)in_file) < 0) {
+    if (decode_threads > 1 && !can_split)
+      cosby_print("Only plain 16 bit mono recordings at the --rate can be split up. Using one thread.\n");
+
+    /* Read the audio right into the decoder, until it runs out or
+       the decoder says the signal is over */
+    for (;;) {
+      buffer = cosby_decoder_buffer(decoder, &room);
+      if (room > AUDIO_READ_SIZE)
+	room = AUDIO_READ_SIZE;
+      stage = stats_enter(recording_stats, STAGE_READ);
+      count = (*read_samples)(in_file, buffer, room);
+      stats_enter(recording_stats, stage);
+      if (count > 0)
+	stats.samples += count;
+      if (count > 0 && cosby_decoder_commit(decoder, count))
+	break;
+      flush_if_requested(recording_sink);
+      if (count < (int)room || interrupted) {
+	cosby_decoder_finish(decoder);
+	break;
+      }
+      total_read += count;
+      if (wave_filename == NULL && !got_signal &&
+	  total_read > record_settings.input_rate*MAX_WAIT) {
+	cosby_print("No signal found. Giving up.\n");
+	break;
+      }
+    }
+  }
+  sigaction(SIGINT, &old_action, NULL);
+  recording_sink = NULL;
+  if (interrupted)
+    cosby_print("Stopped.\n");
+  cosby_print("Done!\n");
+
+  if (split_records)
+    finish_splitting(&split);
   else
-    out_file = fopen(data_filename,"wb");
+    sink_close(&out);
+  if (!split_records && out.tee != NULL) {
+    if (!interrupted && !out.failed)
+      cache_result(key, wave_filename, &cache_copy);
+    sink_close(&cache_copy);
+  }
+
+  close_input(in_file);
+  cosby_decoder_free(decoder);
 
-  get_frequencies = fftw_plan_dft_r2c_1d(DEFAULT_WAVELENGTH, audio_samples,
-					 harmonics,
-					 FFTW_ESTIMATE | FFTW_DESTROY_INPUT);
+  if (recording_stats != NULL) {
+    stats_enter(recording_stats, STAGE_OTHER);
+    recording_stats = NULL;
+    report_stats(&stats, wave_filename, &record_settings);
+  }
+  return 1;
+}
+
+/* The wisdom only holds for the kind of CPU it was measured on, so
+   the CPU goes in the file name, like
+   ~/.cache/cosby/wisdom-Intel-R-Core-TM-i5-2500K-CPU-3-30GHz. FFTW
+   keeps track of the sizes itself. Returns NULL if there's nowhere to
+   put it. */
+char *default_wisdom_file() {
+  const char *fields[] = { "model name", "Model", "Hardware", "cpu model", "cpu", NULL };
+  char line[256];
+  char cpu[128];
+  char *value;
+  char *end;
+  char *dir;
+  char *name;
+  FILE *cpuinfo;
+  size_t length = 0;
+
+  cpuinfo = fopen("/proc/cpuinfo", "r");
+  if (cpuinfo != NULL) {
+    while (length == 0 && fgets(line, sizeof(line), cpuinfo) != NULL) {
+      /* Lines look like "model name\t: Intel(R) Core(TM)..." */
+      value = strchr(line, ':');
+      if (value == NULL)
+	continue;
+      for (end = value;end > line && (end[-1] == ' ' || end[-1] == '\t');end--);
+      (*end) = 0;
+      for (int c=0;fields[c] != NULL;c++) {
+	if (0==strcmp(line, fields[c])) {
+	  /* Anything but letters and numbers turns into a dash */
+	  for (value++;*value != 0 && length < sizeof(cpu)-1;value++) {
+	    if (isalnum((unsigned char)*value))
+	      cpu[length++] = *value;
+	    else if (length > 0 && cpu[length-1] != '-')
+	      cpu[length++] = '-';
+	  }
+	  while (length > 0 && cpu[length-1] == '-')
+	    length--;
+	  cpu[length] = 0;
+	  break;
+	}
+      }
+    }
+    fclose(cpuinfo);
+  }
+  if (length == 0)
+    strcpy(cpu, "unknown");
+
+  if ((dir = cache_dir(0)) == NULL)
+    return NULL;
+  name = malloc(strlen(dir)+strlen(cpu)+16);
+  if (name != NULL)
+    sprintf(name, "%s/wisdom-%s", dir, cpu);
+  free(dir);
+  return name;
+}
+
+/* Only the commands that decode plan any transforms, so they're the
+   only ones that bother with the wisdom */
+void load_wisdom_file() {
+  if (!use_wisdom)
+    return;
+  if (wisdom_file == NULL) {
+    wisdom_file = default_wisdom_file();
+    default_wisdom = 1;
+  }
+  if (wisdom_file != NULL)
+    cosby_load_wisdom(wisdom_file);
+}
+
+/* Only measuring makes new wisdom worth keeping, and ~/.cache/cosby
+   doesn't get made until there is some */
+void save_wisdom_file() {
+  char *dir;
+  if (!use_wisdom || wisdom_file == NULL || !measured_plan)
+    return;
+  if (default_wisdom && (dir = cache_dir(1)) != NULL)
+    free(dir);
+  if (cosby_save_wisdom(wisdom_file) != 0)
+    cosby_print_err("Couldn't save FFTW's wisdom to %s\n",wisdom_file);
+}
+
+/* =======================================================
+                         Batch
+   ======================================================= */
+
+/* Decoding a whole archive of tapes one at a time leaves every core
+   but one sitting around. Batch mode decodes a pile of recordings at
+   once.
+
+   Each recording gets its own process. If one of them chokes on a
+   mangled file, it doesn't take the rest down with it. Unix has been
+   doing this since before the TI99/4a existed. */
+
+struct batch_job {
+  char *input;
+  char *output;
+  pid_t pid;
+  int status;
+  struct timespec start;
+  double seconds;
+};
+
+struct batch_job *batch_jobs;
+size_t num_batch_jobs = 0;
+size_t batch_jobs_size = 0;
+
+/* How we decided how each job went */
+#define BATCH_DECODED   0
+#define BATCH_NO_SIGNAL 1
+#define BATCH_FAILED    2
+
+int is_audio_filename(char *filename) {
+  size_t length = strlen(filename);
+  return (length > 4 &&
+	  (0==strcasecmp(filename+length-4,".wav") ||
+	   0==strcasecmp(filename+length-4,".raw") ||
+	   0==strcasecmp(filename+length-4,".pcm")));
+}
+
+/* Adds a job to decode input into a .dat file named after it in
+   out_dir. If two inputs have the same name, the later ones get a
+   number tacked on so nobody overwrites anybody. */
+int add_batch_job(char *input, char *out_dir) {
+  char *name;
+  char *dot;
+  size_t length;
+  int copy = 1;
+
+  if (num_batch_jobs == batch_jobs_size) {
+    batch_jobs_size = batch_jobs_size ? batch_jobs_size*2 : 64;
+    batch_jobs = realloc(batch_jobs, sizeof(struct batch_job)*batch_jobs_size);
+    if (batch_jobs == NULL)
+      return -1;
+  }
+
+  name = strrchr(input,'/');
+  name = (name == NULL) ? input : name+1;
+  dot = strrchr(name,'.');
+  length = (dot == NULL || dot == name) ? strlen(name) : (size_t)(dot-name);
+
+  batch_jobs[num_batch_jobs].input = strdup(input);
+  batch_jobs[num_batch_jobs].output = malloc(strlen(out_dir)+length+32);
+  if (batch_jobs[num_batch_jobs].input == NULL ||
+      batch_jobs[num_batch_jobs].output == NULL)
+    return -1;
+  sprintf(batch_jobs[num_batch_jobs].output,"%s/%.*s.dat",out_dir,(int)length,name);
+  for (int c=0;c<num_batch_jobs;c++) {
+    if (0==strcmp(batch_jobs[c].output,batch_jobs[num_batch_jobs].output)) {
+      sprintf(batch_jobs[num_batch_jobs].output,"%s/%.*s-%d.dat",
+	      out_dir,(int)length,name,++copy);
+      c = -1;
+    }
+  }
+  batch_jobs[num_batch_jobs].pid = 0;
+  batch_jobs[num_batch_jobs].status = BATCH_FAILED;
+  batch_jobs[num_batch_jobs].seconds = 0.0;
+  num_batch_jobs++;
+  return 0;
+}
+
+int compare_strings(const void *a, const void *b) {
+  return strcmp(*(char **)a, *(char **)b);
+}
 
+/* Adds every recording in a directory, in alphabetical order so
+   reruns come out the same */
+int add_batch_directory(char *dir_name, char *out_dir) {
+  DIR *dir;
+  struct dirent *entry;
+  char **names = NULL;
+  char **more_names;
+  size_t num_names = 0;
+  int result = 0;
 
-  while ((samples_read = audio_at_offset(read_samples, in_file, audio_samples, offset++, DEFAULT_WAVELENGTH))>0) {
-    apply_window_func(audio_samples);
-    fftw_execute(get_frequencies);
-    if (process_harmonics(harmonics, num_harmonics, out_file))
+  if ((dir = opendir(dir_name)) == NULL) {
+    cosby_print_err("Couldn't open %s\n",dir_name);
+    return -1;
+  }
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.' || !is_audio_filename(entry->d_name))
+      continue;
+    more_names = realloc(names, sizeof(char *)*(num_names+1));
+    if (more_names != NULL) {
+      names = more_names;
+      names[num_names] = malloc(strlen(dir_name)+strlen(entry->d_name)+2);
+    }
+    if (more_names == NULL || names[num_names] == NULL) {
+      cosby_print_err("Out of memory for the recordings in %s\n",dir_name);
+      result = -1;
       break;
+    }
+    sprintf(names[num_names++],"%s/%s",dir_name,entry->d_name);
   }
-  cosby_print("Done!\n");
+  closedir(dir);
+
+  if (result == 0)
+    qsort(names, num_names, sizeof(char *), &compare_strings);
+  for (int c=0;c<num_names;c++) {
+    if (result == 0)
+      result = add_batch_job(names[c], out_dir);
+    free(names[c]);
+  }
+  free(names);
+  return result;
+}
 
-  if (data_filename != NULL)    
-    fclose(out_file);
- 
-  fftw_destroy_plan(get_frequencies);
+/* A list file has one recording on each line */
+int add_batch_list(char *list_name, char *out_dir) {
+  FILE *list;
+  char line[4096];
+  size_t length;
 
-  fftw_free(harmonics);
-  fftw_free(audio_samples);
-  if (wave_filename == NULL) {
-  } else {
-    free_audio_buffer(in_file);
+  if ((list = fopen(list_name,"r")) == NULL) {
+    cosby_print_err("Couldn't open %s\n",list_name);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), list) != NULL) {
+    length = strlen(line);
+    while (length > 0 && (line[length-1] == '\n' || line[length-1] == '\r'))
+      line[--length] = 0;
+    if (length > 0 && add_batch_job(line, out_dir) < 0) {
+      fclose(list);
+      return -1;
+    }
+  }
+  fclose(list);
+  return 0;
+}
+
+/* This runs in the child process. Decode one recording, and tell the
+   parent how it went with the exit code. */
+void run_batch_job(struct batch_job *job) {
+  int result;
+
+  /* The "Got a signal!" chatter from a couple dozen decodes all at once
+     is just noise. The summary tells the story. Errors still go to
+     stderr. */
+  if (freopen("/dev/null","w",stdout) == NULL)
+    _exit(BATCH_FAILED);
+  result = press_record(job->output, job->input);
+  save_wisdom_file();
+  fflush(NULL);
+  if (result < 0)
+    _exit(BATCH_FAILED);
+  _exit(got_signal ? BATCH_DECODED : BATCH_NO_SIGNAL);
+}
+
+double seconds_since(struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec-start->tv_sec)+(now.tv_nsec-start->tv_nsec)/1e9;
+}
+
+/* Prints the summary to the screen and to summary.txt in out_dir */
+void write_batch_summary(char *out_dir, double total_seconds) {
+  char *summary_name;
+  FILE *summary;
+  struct stat file_stat;
+  char *status_names[] = { "decoded", "no signal", "failed" };
+  int counts[3] = { 0, 0, 0 };
+  long long bytes;
+
+  summary_name = malloc(strlen(out_dir)+16);
+  sprintf(summary_name,"%s/summary.txt",out_dir);
+  summary = fopen(summary_name,"w");
+  if (summary == NULL)
+    cosby_print_err("Couldn't write %s\n",summary_name);
+
+  for (int c=0;c<num_batch_jobs;c++) {
+    bytes = 0;
+    if (stat(batch_jobs[c].output, &file_stat) == 0)
+      bytes = file_stat.st_size;
+    counts[batch_jobs[c].status]++;
+    cosby_print("%-10s %10lld bytes %8.2fs %s -> %s\n",
+		status_names[batch_jobs[c].status], bytes,
+		batch_jobs[c].seconds, batch_jobs[c].input, batch_jobs[c].output);
+    if (summary != NULL)
+      fprintf(summary,"%s\t%lld\t%.2f\t%s\t%s\n",
+	      status_names[batch_jobs[c].status], bytes,
+	      batch_jobs[c].seconds, batch_jobs[c].input, batch_jobs[c].output);
   }
-  free_history();
-  free_window();
+  cosby_print("%d decoded, %d with no signal, %d failed in %.2fs\n",
+	      counts[BATCH_DECODED], counts[BATCH_NO_SIGNAL], counts[BATCH_FAILED],
+	      total_seconds);
+  if (summary != NULL)
+    fclose(summary);
+  free(summary_name);
+}
 
-  return 1;
+/* Decodes every input into out_dir, running one job per core at a
+   time. An input can be a recording, a directory of recordings, or
+   @ followed by the name of a list file. */
+int batch_record(char *out_dir, char **inputs, int num_inputs) {
+  struct timespec start;
+  struct stat file_stat;
+  long cores;
+  int running = 0;
+  size_t next = 0;
+  pid_t pid;
+  int wait_status;
+  int result;
+  struct cosby_decoder *planned;
+
+  for (int c=0;c<num_inputs;c++) {
+    if (inputs[c][0] == '@')
+      result = add_batch_list(inputs[c]+1, out_dir);
+    else if (stat(inputs[c], &file_stat) == 0 && S_ISDIR(file_stat.st_mode))
+      result = add_batch_directory(inputs[c], out_dir);
+    else
+      result = add_batch_job(inputs[c], out_dir);
+    if (result < 0)
+      return -1;
+  }
+  if (num_batch_jobs == 0) {
+    cosby_print_err("There's nothing to decode\n");
+    return -1;
+  }
+  if (mkdir(out_dir, 0777) < 0 && errno != EEXIST) {
+    cosby_print_err("Couldn't make %s\n",out_dir);
+    return -1;
+  }
+
+  cores = batch_workers;
+  if (cores <= 0)
+    cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cores <= 0)
+    cores = 1;
+  cosby_print("Decoding %d recordings, %ld at a time\n",(int)num_batch_jobs,cores);
+
+  /* Measure here, once, so the children all start out with the
+     wisdom instead of every one of them measuring the same thing at
+     the same time */
+  if (settings.plan != PLAN_ESTIMATE) {
+    planned = cosby_decoder_new(&settings, NULL, NULL, NULL);
+    if (planned != NULL)
+      cosby_decoder_free(planned);
+    save_wisdom_file();
+  }
+
+  /* Anything sitting in stdout's buffer would get printed again by
+     every child */
+  fflush(NULL);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (next < num_batch_jobs || running > 0) {
+    /* Keep every core busy */
+    while (next < num_batch_jobs && running < cores) {
+      clock_gettime(CLOCK_MONOTONIC, &batch_jobs[next].start);
+      pid = fork();
+      if (pid == 0) {
+	run_batch_job(&batch_jobs[next]);
+      } else if (pid < 0) {
+	cosby_print_err("Couldn't start a job for %s\n",batch_jobs[next].input);
+	batch_jobs[next].status = BATCH_FAILED;
+      } else {
+	batch_jobs[next].pid = pid;
+	running++;
+      }
+      next++;
+    }
+    if (running == 0)
+      break;
+
+    /* Wait for somebody to finish */
+    pid = wait(&wait_status);
+    if (pid < 0)
+      break;
+    for (int c=0;c<num_batch_jobs;c++) {
+      if (batch_jobs[c].pid == pid) {
+	batch_jobs[c].seconds = seconds_since(&batch_jobs[c].start);
+	if (WIFEXITED(wait_status) && WEXITSTATUS(wait_status) <= BATCH_FAILED)
+	  batch_jobs[c].status = WEXITSTATUS(wait_status);
+	else
+	  batch_jobs[c].status = BATCH_FAILED;
+	batch_jobs[c].pid = 0;
+	running--;
+      }
+    }
+  }
+
+  write_batch_summary(out_dir, seconds_since(&start));
+  for (int c=0;c<num_batch_jobs;c++) {
+    free(batch_jobs[c].input);
+    free(batch_jobs[c].output);
+  }
+  free(batch_jobs);
+  return 0;
 }
 
 /* =======================================================
                        Entry point
    ======================================================= */
 
+/* Options start with "--" and can go anywhere on the command
+   line. They get pulled out of argv here, so the rest of main() never
+   sees them. Returns the new argc, or -1 for an option we don't
+   understand. */
+int parse_options(int argc, char *argv[]) {
+  int new_argc = 1;
+  for (int c=1;c<argc;c++) {
+    if (0==strncmp(argv[c],"--",2)) {
+      if (0==strcmp(argv[c],"--engine=fft")) {
+	settings.engine = ENGINE_FFT;
+      } else if (0==strcmp(argv[c],"--engine=sdft")) {
+	settings.engine = ENGINE_SDFT;
+      } else if (0==strcmp(argv[c],"--engine=direct")) {
+	settings.engine = ENGINE_DIRECT;
+      } else if (0==strcmp(argv[c],"--precision=double")) {
+	settings.precision = PRECISION_DOUBLE;
+      } else if (0==strcmp(argv[c],"--precision=float")) {
+	settings.precision = PRECISION_FLOAT;
+      } else if (0==strcmp(argv[c],"--precision=fixed")) {
+	settings.precision = PRECISION_FIXED;
+      } else if (0==strcmp(argv[c],"--simd=scalar")) {
+	settings.simd = SIMD_SCALAR;
+      } else if (0==strcmp(argv[c],"--simd=sse2")) {
+	settings.simd = SIMD_SSE2;
+      } else if (0==strcmp(argv[c],"--simd=avx2")) {
+	settings.simd = SIMD_AVX2;
+      } else if (0==strcmp(argv[c],"--simd=avx512")) {
+	settings.simd = SIMD_AVX512;
+      } else if (0==strncmp(argv[c],"--jobs=",7)) {
+	batch_workers = atoi(argv[c]+7);
+      } else if (0==strcmp(argv[c],"--realtime")) {
+	capture_realtime = 1;
+      } else if (0==strcmp(argv[c],"--records")) {
+	split_records = 1;
+      } else if (0==strncmp(argv[c],"--index=",8)) {
+	index_filename = argv[c]+8;
+      } else if (0==strncmp(argv[c],"--record=",9)) {
+	index_record = atoi(argv[c]+9);
+      } else if (0==strcmp(argv[c],"--flush=record")) {
+	flush_policy = FLUSH_RECORD;
+      } else if (0==strcmp(argv[c],"--flush=signal")) {
+	flush_policy = FLUSH_SIGNAL;
+      } else if (0==strncmp(argv[c],"--flush=",8) && atoi(argv[c]+8) > 0) {
+	flush_policy = FLUSH_BYTES;
+	flush_bytes = atoi(argv[c]+8);
+      } else if (0==strncmp(argv[c],"--signal-range=",15)) {
+	sweep_signal_range = argv[c]+15;
+	settings.signal_range = atof(argv[c]+15);
+	if (settings.signal_range <= 1.0) {
+	  cosby_print_err("The signal range has to be more than 1\n");
+	  return -1;
+	}
+      } else if (0==strncmp(argv[c],"--power-average=",16)) {
+	sweep_power_average = argv[c]+16;
+	settings.power_average = atof(argv[c]+16);
+	if (settings.power_average < 1.0) {
+	  cosby_print_err("The power has to be averaged over at least 1 symbol\n");
+	  return -1;
+	}
+      } else if (0==strncmp(argv[c],"--threshold=",12)) {
+	sweep_threshold = argv[c]+12;
+	settings.threshold = atof(argv[c]+12);
+      } else if (0==strncmp(argv[c],"--repeat-after=",15)) {
+	sweep_repeat_after = argv[c]+15;
+	settings.repeat_after = atof(argv[c]+15);
+	if (settings.repeat_after <= 1.0) {
+	  cosby_print_err("Repeating has to take more than 1 symbol\n");
+	  return -1;
+	}
+      } else if (0==strcmp(argv[c],"--stats")) {
+	show_stats = 1;
+      } else if (0==strncmp(argv[c],"--stats=",8)) {
+	show_stats = 1;
+	stats_filename = argv[c]+8;
+      } else if (0==strcmp(argv[c],"--cache")) {
+	use_cache = 1;
+      } else if (0==strncmp(argv[c],"--cache=",8)) {
+	use_cache = 1;
+	cache_directory = argv[c]+8;
+      } else if (0==strcmp(argv[c],"--no-skip")) {
+	settings.skip_quiet = 0;
+      } else if (0==strcmp(argv[c],"--timing=sample")) {
+	settings.timing = TIMING_SAMPLE;
+      } else if (0==strcmp(argv[c],"--timing=symbol")) {
+	settings.timing = TIMING_SYMBOL;
+      } else if (0==strcmp(argv[c],"--plan=estimate")) {
+	settings.plan = PLAN_ESTIMATE;
+      } else if (0==strcmp(argv[c],"--plan=measure")) {
+	settings.plan = PLAN_MEASURE;
+      } else if (0==strcmp(argv[c],"--plan=patient")) {
+	settings.plan = PLAN_PATIENT;
+      } else if (0==strncmp(argv[c],"--wisdom=",9)) {
+	wisdom_file = argv[c]+9;
+      } else if (0==strcmp(argv[c],"--no-wisdom")) {
+	use_wisdom = 0;
+      } else if (0==strncmp(argv[c],"--rate=",7)) {
+	settings.rate = atoi(argv[c]+7);
+	if (settings.rate < MIN_SAMPLE_RATE) {
+	  cosby_print_err("The rate has to be at least %d\n",MIN_SAMPLE_RATE);
+	  return -1;
+	}
+      } else if (0==strncmp(argv[c],"--threads=",10)) {
+	decode_threads = atoi(argv[c]+10);
+	if (decode_threads <= 0)
+	  decode_threads = sysconf(_SC_NPROCESSORS_ONLN);
+      } else {
+	cosby_print_err("I don't know what %s means\n",argv[c]);
+	return -1;
+      }
+    } else {
+      argv[new_argc++] = argv[c];
+    }
+  }
+  argv[new_argc] = NULL;
+  return new_argc;
+}
+
 /* Parse the arguments and invoke either play or record */
 int main(int argc, char *argv[]) {
   int result;
+  char *index_name;
+  cosby_settings_init(&settings);
+  settings.plan = DEFAULT_PLAN;
+  if ((argc = parse_options(argc, argv)) < 0)
+    return 1;
   if ((argc>=3 && argc <= 5) &&
       0==strcmp(argv[1],"press") &&
       0==strcmp(argv[2],"record")) {
+    load_wisdom_file();
     if (argc == 3 || (argv[3][0]=='-' && argv[3][1] == 0)) {
 
       /* Redirect all messages to stderr */
@@ -1162,12 +5723,91 @@ int main(int argc, char *argv[]) {
       result = press_play(argv[3],argv[4]);
     }
 
+  } else if (argc == 3 && 0==strcmp(argv[1],"sweep")) {
+    load_wisdom_file();
+    cosby_print("Sweeping %s\n",argv[2]);
+    result = sweep(argv[2]);
+  } else if (argc == 4 && 0==strcmp(argv[1],"soft")) {
+    load_wisdom_file();
+    cosby_print("Saving the soft decisions for %s to %s\n",argv[2],argv[3]);
+    result = save_soft(argv[3], argv[2]);
+  } else if ((argc == 3 || argc == 4) &&
+	     0==strcmp(argv[1],"scan")) {
+    index_name = (argc == 4) ? argv[3] : index_name_for(argv[2]);
+    cosby_print("Scanning %s to %s\n",argv[2],index_name);
+    result = scan_recording(argv[2], index_name);
+  } else if (argc >= 5 &&
+	     0==strcmp(argv[1],"batch") &&
+	     0==strcmp(argv[2],"record")) {
+    load_wisdom_file();
+    result = batch_record(argv[3], argv+4, argc-4);
   } else {    
     cosby_print("Cosby is TI99/4a data cassette interface software modem \n\n");
     cosby_print("Usage: %s press record <output.dat> [<input.wav>]\n",argv[0]);
     cosby_print("       %s press play <input.dat> [<output.wav>]\n",argv[0]);
+    cosby_print("       %s batch record <output dir> <input.wav|dir|@list>...\n",argv[0]);
+    cosby_print("       %s scan <input.wav> [<index.idx>]\n",argv[0]);
+    cosby_print("       %s soft <input.wav> <output.soft>\n",argv[0]);
+    cosby_print("       %s sweep <input.wav|input.soft>\n",argv[0]);
     cosby_print("\n  Hint: '-' as <output.dat> or <input.dat> for stdin and stdout\n");
+    cosby_print("\nOptions:\n");
+    cosby_print("  --engine=fft|sdft|direct\n");
+    cosby_print("                     How to find the frequencies when recording.\n");
+    cosby_print("                     sdft (sliding DFT) and direct are much faster.\n");
+    cosby_print("                     (default fft)\n");
+    cosby_print("  --jobs=N           Decode N recordings at once in batch mode.\n");
+    cosby_print("                     (default one per core)\n");
+    cosby_print("  --threads=N        Split one recording between N threads. 0 means\n");
+    cosby_print("                     one per core. (default 1)\n");
+    cosby_print("  --realtime         Record live audio with real-time priority.\n");
+    cosby_print("  --precision=double|float|fixed\n");
+    cosby_print("                     The kind of numbers to find the frequencies\n");
+    cosby_print("                     with. (default double)\n");
+    cosby_print("  --simd=scalar|sse2|avx2|avx512\n");
+    cosby_print("                     The widest SIMD instructions to use. (default\n");
+    cosby_print("                     whatever the CPU has)\n");
+    cosby_print("  --rate=N           Decode at N samples per second. 11025 is about\n");
+    cosby_print("                     four times faster. (default 44100)\n");
+    cosby_print("  --timing=sample|symbol\n");
+    cosby_print("                     Look for symbols at every sample, or once per\n");
+    cosby_print("                     symbol and follow the tape speed. (default sample)\n");
+    cosby_print("  --records          Keep going after the first record on the tape,\n");
+    cosby_print("                     and save each one to its own numbered file.\n");
+    cosby_print("  --index=FILE       Decode the records listed in an index from scan\n");
+    cosby_print("                     or --records, each to its own numbered file.\n");
+    cosby_print("  --record=N         Decode just record N from the index, which is\n");
+    cosby_print("                     <input>.idx unless you say otherwise.\n");
+    cosby_print("  --flush=record|signal|N\n");
+    cosby_print("                     Write the output at the end of each record,\n");
+    cosby_print("                     only when stopping, or every N bytes.\n");
+    cosby_print("                     (default record)\n");
+    cosby_print("  --signal-range=X   The signal's over when it's X times weaker.\n");
+    cosby_print("                     (default 16)\n");
+    cosby_print("  --power-average=X  Average the signal strength over X symbols.\n");
+    cosby_print("                     (default 2)\n");
+    cosby_print("  --threshold=X      Where a \"0\" turns into a \"1\", as a fraction\n");
+    cosby_print("                     of full scale. (default 0)\n");
+    cosby_print("  --repeat-after=X   It's the same bit again after X symbols.\n");
+    cosby_print("                     (default 1.5)\n");
+    cosby_print("                     sweep tries every combination of these, and\n");
+    cosby_print("                     each can be a list, like --signal-range=8,16,32\n");
+    cosby_print("  --stats[=FILE]     Say where the time went while recording, or add\n");
+    cosby_print("                     it to FILE as JSON\n");
+    cosby_print("  --cache[=DIR]      Keep decoded recordings, and don't decode the\n");
+    cosby_print("                     same one the same way twice. (default\n");
+    cosby_print("                     ~/.cache/cosby/results)\n");
+    cosby_print("  --no-skip          Decode the silence and lead-in too, instead of\n");
+    cosby_print("                     skipping through them.\n");
+    cosby_print("  --plan=estimate|measure|patient\n");
+    cosby_print("                     How hard FFTW looks for the fastest FFT.\n");
+    cosby_print("                     (default estimate)\n");
+    cosby_print("  --wisdom=FILE      Where to keep what FFTW finds out. (default\n");
+    cosby_print("                     ~/.cache/cosby/wisdom-<your CPU>)\n");
+    cosby_print("  --no-wisdom        Don't load or save it.\n");
     result = 1;
   }
+  save_wisdom_file();
   return result;
 }
+
+#endif
@@ -0,0 +1,214 @@
+/* libcosby - the TI99/4a data cassette software modem as a library */
+/* Copyright (C) 2012 Nicholas Nassar */
+
+/* -------------------------------------------------------------------
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+   ------------------------------------------------------------------- */
+/*
+This is the same modem the cosby program uses, minus the sound card
+and the files. You push audio into a decoder and it calls you back
+with bytes, or you push bytes into an encoder and it calls you back
+with audio.
+
+Each decoder and encoder is completely separate, so you can run as
+many as you like in one process. Just don't use the same one from two
+threads at once. FFTW's planner isn't thread safe, but the library
+takes care of that itself, so making and freeing decoders and
+encoders and loading and saving wisdom are all fine from any thread.
+If your own program uses FFTW's planner too, that part's up to you.
+
+Audio is mono, as doubles between -1 and 1, like 16 bit samples
+divided by 32768. The decoder takes any sample rate you tell it
+about. In doubles and floats, it doesn't care how loud it is, but
+COSBY_PRECISION_FIXED turns the audio into 16 bit numbers, and
+anything past -1 or 1 gets clipped. The encoder makes audio at 44100
+samples per second, between -1 and 1.
+
+Build it with "make libcosby.so"
+*/
+
+#ifndef COSBY_H
+#define COSBY_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define COSBY_API __attribute__((visibility("default")))
+#else
+#define COSBY_API
+#endif
+
+/* The ways a decoder can find the "0" and "1" frequencies */
+#define COSBY_ENGINE_FFT    0
+#define COSBY_ENGINE_SDFT   1
+#define COSBY_ENGINE_DIRECT 2
+
+/* The widest SIMD instructions a decoder can use. It uses the widest
+   one the CPU has, up to this. They all give exactly the same
+   answers. */
+#define COSBY_SIMD_SCALAR 0
+#define COSBY_SIMD_SSE2   1
+#define COSBY_SIMD_AVX2   2
+#define COSBY_SIMD_AVX512 3
+
+/* The kind of numbers a decoder finds the frequencies with. Doubles
+   are the reference. Floats and 16 bit fixed point are faster on
+   small ARM boards, and don't give exactly the same numbers. Fixed
+   point always uses COSBY_ENGINE_DIRECT, and floats use it instead of
+   COSBY_ENGINE_SDFT. */
+#define COSBY_PRECISION_DOUBLE 0
+#define COSBY_PRECISION_FLOAT  1
+#define COSBY_PRECISION_FIXED  2
+
+/* How hard FFTW tries to find the fastest way to do the FFT
+   engine's transforms. Measuring takes a while, but FFTW remembers
+   what it found, and cosby_save_wisdom() can keep it for next time. */
+#define COSBY_PLAN_ESTIMATE 0
+#define COSBY_PLAN_MEASURE  1
+#define COSBY_PLAN_PATIENT  2
+
+/* How a decoder decides where the symbols are. COSBY_TIMING_SAMPLE
+   looks at every sample, and starts a new symbol wherever the
+   frequency changes. COSBY_TIMING_SYMBOL looks once per symbol, right
+   in the middle, and keeps itself lined up with the edges as the tape
+   speeds up and slows down. It's a lot less work. It can't use
+   COSBY_ENGINE_SDFT, so it uses COSBY_ENGINE_DIRECT instead. */
+#define COSBY_TIMING_SAMPLE 0
+#define COSBY_TIMING_SYMBOL 1
+
+/* Things a decoder tells you about besides bytes */
+#define COSBY_EVENT_FRAMED 1 /* Found the start of the data */
+#define COSBY_EVENT_DONE   2 /* The signal went away */
+
+/* Decoder and encoder settings. Fill one in with
+   cosby_settings_init(), change what you like, and pass it to
+   cosby_decoder_new(). The decoder keeps its own copy. */
+struct cosby_settings {
+  int engine;     /* One of the COSBY_ENGINE_ definitions */
+  int input_rate; /* Samples per second of the audio you push in */
+  int rate;       /* Samples per second the decoder works at. If it's
+		     not input_rate, the audio gets resampled. Lower
+		     is faster. At least 8000. */
+  int simd;       /* One of the COSBY_SIMD_ definitions */
+  int precision;  /* One of the COSBY_PRECISION_ definitions */
+  int plan;       /* One of the COSBY_PLAN_ definitions */
+  int timing;     /* One of the COSBY_TIMING_ definitions */
+  int skip_quiet; /* 1 to skip through silence and most of the
+		     lead-in without decoding it. On by default. */
+  int keep_going; /* 1 to keep looking for more data after the
+		     signal ends, for tapes with more than one thing
+		     saved on them. Each one starts with
+		     COSBY_EVENT_FRAMED and ends with COSBY_EVENT_DONE. */
+
+  /* How the decoder turns the power at the two frequencies into bits,
+     and decides when the signal's over. The defaults work for most
+     tapes. */
+  double signal_range;  /* The signal's over when it gets this many
+			   times weaker than it started out */
+  double power_average; /* How many symbols the signal strength gets
+			   averaged over */
+  double threshold;     /* How much stronger the "0" frequency has to
+			   be than the "1" for a "0", as a fraction of
+			   a full scale "0" */
+  double repeat_after;  /* How many symbols without a change before
+			   it's the same bit again */
+};
+
+/* Called with decoded bytes. */
+typedef void (*cosby_bytes_callback)(void *user, const unsigned char *bytes,
+				     size_t count);
+
+/* Called when something happens. offset is the number of samples
+   into the audio where it happened, at the rate the decoder works
+   at. */
+typedef void (*cosby_event_callback)(void *user, int event, size_t offset);
+
+/* Called with encoded audio. */
+typedef void (*cosby_samples_callback)(void *user, const double *samples,
+				       size_t count);
+
+struct cosby_decoder;
+struct cosby_encoder;
+
+COSBY_API void cosby_settings_init(struct cosby_settings *settings);
+
+/* Makes a new decoder. Either callback can be NULL. Returns NULL if
+   it can't. */
+COSBY_API struct cosby_decoder *cosby_decoder_new(const struct cosby_settings *settings,
+						  cosby_bytes_callback on_bytes,
+						  cosby_event_callback on_event,
+						  void *user);
+
+/* Decodes count samples. Returns 1 once the signal has ended, and
+   ignores anything pushed after that. With keep_going, it never
+   ends. */
+COSBY_API int cosby_decoder_push(struct cosby_decoder *decoder,
+				 const double *samples, size_t count);
+
+/* If you're reading audio from somewhere anyway, you can skip a copy
+   by reading it right into the decoder. This returns where to put up
+   to *room samples. Then call cosby_decoder_commit() with how many
+   you put there. Returns 1 once the signal has ended, like
+   cosby_decoder_push(). */
+COSBY_API double *cosby_decoder_buffer(struct cosby_decoder *decoder,
+				       size_t *room);
+COSBY_API int cosby_decoder_commit(struct cosby_decoder *decoder,
+				   size_t count);
+
+/* Call this when there's no more audio. It decodes whatever's left. */
+COSBY_API int cosby_decoder_finish(struct cosby_decoder *decoder);
+
+/* Whether the decoder has found the start of the data */
+COSBY_API int cosby_decoder_framed(struct cosby_decoder *decoder);
+
+/* How loud the data has been since it was framed, in dB compared to
+   a full scale "0" tone. Call it when you get COSBY_EVENT_DONE to
+   find out how loud the data that just ended was. */
+COSBY_API double cosby_decoder_level(struct cosby_decoder *decoder);
+
+COSBY_API void cosby_decoder_free(struct cosby_decoder *decoder);
+
+/* Makes a new encoder. Returns NULL if it can't. */
+COSBY_API struct cosby_encoder *cosby_encoder_new(cosby_samples_callback on_samples,
+						  void *user);
+
+/* Encodes count bytes. The first call sends the lead-in first. Audio
+   comes out in big blocks, so some of it may not show up until the
+   next write or cosby_encoder_finish(). */
+COSBY_API void cosby_encoder_write(struct cosby_encoder *encoder,
+				   const unsigned char *bytes, size_t count);
+
+/* Finishes off the audio and sends whatever's left. Call it once,
+   after the last write. */
+COSBY_API void cosby_encoder_finish(struct cosby_encoder *encoder);
+
+COSBY_API void cosby_encoder_free(struct cosby_encoder *encoder);
+
+/* FFTW's wisdom is everything it's measured about how to do
+   transforms fastest on this computer. Load it before making
+   decoders, and they don't have to measure again. Saving doesn't
+   touch the file unless something new got measured since it was
+   loaded or saved. Both return 0 if they worked. */
+COSBY_API int cosby_load_wisdom(const char *filename);
+COSBY_API int cosby_save_wisdom(const char *filename);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif